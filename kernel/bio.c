@@ -1,10 +1,22 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are allocated from a slab cache on demand: the cache
+// grows while free memory is plentiful, shrinks again when it
+// runs low, and hands buffers back when kalloc() runs out (see
+// bshrink). Lookups go through a power-of-two hash table that
+// is resized to match the number of buffers.
+//
+// Replacement is 2Q: a block enters the cold queue, which is
+// FIFO, and is only moved to the hot queue (managed as a CLOCK)
+// if it is missed again soon after being evicted from the cold
+// queue. A sequential scan therefore only displaces blocks that
+// were never re-used.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -12,6 +24,14 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// Locking: a buffer's hash chain, refcnt and ref bit are
+// protected by one of NSTRIPE stripe locks. bcache.lock is
+// only taken on a miss; it protects the queues, the ghost
+// list and the table size, and is acquired before any stripe.
+//
+// Reads and writes go to the driver that registered itself
+// in bdevsw[] for the buffer's device.
 
 
 #include "types.h"
@@ -22,145 +42,405 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
-#define NBUCKET 13
+
+#define NSTRIPE   16    // locks covering the hash buckets
+#define NGHOST    512   // blocks recently evicted from the cold queue
+#define BFREE_MIN 1024  // grow the cache only while more pages are free
 
 struct {
-  struct spinlock lock[NBUCKET];
+  struct spinlock lock;
+  struct spinlock stripe[NSTRIPE];
+  struct kmem_cache *cache;
 
-  struct buf buf[NBUF];
+  struct buf **table;   // hash chains, through hnext
+  uint nbucket;         // a power of two, at least NSTRIPE
+  int order;            // table came from kalloc_pages(order)
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf unused_buf[NBUCKET];
-  struct buf head[NBUCKET];
-  struct spinlock bucket_lock[NBUCKET];
+  // Queues through prev/next. head.next is the newest,
+  // head.prev the oldest (or where the clock hand points).
+  struct buf cold;
+  struct buf hot;
+  int ncold;
+  int nhot;
+  int nbuf;
+
+  uint64 ghost[NGHOST]; // keys of blocks evicted from cold
+  int ghostpos;
 } bcache;
-uint hash(uint dev,uint blockno){
-    return blockno%NBUCKET;
+
+struct bdevsw bdevsw[NDEV];
+
+static struct bdevsw*
+bdev(uint dev)
+{
+  if(dev >= NDEV || bdevsw[dev].submit == 0)
+    panic("bdev: no driver");
+  return &bdevsw[dev];
 }
-uint buf_hash(struct buf* b){
-    return (b-bcache.buf)%NBUCKET;
+
+// Read or write b and wait for the device to finish.
+static void
+brw(struct buf *b, int write)
+{
+  struct bdevsw *d = bdev(b->dev);
+
+  b->done = 0;
+  d->submit(&b, 1, write);
+  d->wait(b);
 }
-void bucket_insert(uint bucket,struct buf* b){
-    if(bucket>=13){
-        panic("bucket_insert");
-    }
-    b->next=bcache.head[bucket].next;
-    b->prev=&bcache.head[bucket];
-    bcache.head[bucket].next->prev=b;
-    bcache.head[bucket].next=b;
-}
-void unused_insert(struct buf* b){
-    uint bucket=(b-bcache.buf)%NBUCKET;
-    acquire(&bcache.lock[bucket]);
-    b->next=bcache.unused_buf[bucket].next;
-    b->prev=&bcache.unused_buf[bucket];
-    bcache.unused_buf[bucket].next->prev=b;
-    bcache.unused_buf[bucket].next=b;
-    release(&bcache.lock[bucket]);
-}
-struct buf* unused_fetch(uint bucket){
-    acquire(&bcache.lock[bucket]);
-    struct buf* b=0;
-    for(struct buf* r = bcache.unused_buf[bucket].prev; r != &bcache.unused_buf[bucket]; r = r->prev){
-        r->prev->next=r->next;
-        r->next->prev=r->prev;
-        r->prev=0;
-        r->next=0;
-        b=r;
-        break;
-    }
-    release(&bcache.lock[bucket]);
-    return b;
+
+static uint
+bhash(uint dev, uint blockno)
+{
+  uint h = (blockno ^ (dev << 24)) * 2654435761U;
+  return h ^ (h >> 16);
 }
-struct buf* unused_steal(uint bucket){
-    struct buf* b=0;
-    for (int i = (bucket+1)%NBUCKET; i != bucket; i=(i+1)%NBUCKET) {
-        b= unused_fetch(i);
-        if(b){
-            break;
-        }
-    }
-    return b;
+
+static struct spinlock*
+bstripe(uint h)
+{
+  return &bcache.stripe[h % NSTRIPE];
 }
-struct buf* unused_get(uint bucket){
-    struct buf* b;
-    b= unused_fetch(bucket);
-    if(!b){
-        b= unused_steal(bucket);
-    }
-    return b;
+
+static uint64
+bkey(uint dev, uint blockno)
+{
+  return ((uint64)dev << 32) | blockno;
+}
+
+static void
+qpush(struct buf *head, struct buf *b)
+{
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
+}
+
+static void
+qremove(struct buf *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+// Caller holds the block's stripe lock.
+static struct buf*
+blookup(uint dev, uint blockno, uint h)
+{
+  struct buf *b;
+
+  for(b = bcache.table[h & (bcache.nbucket-1)]; b; b = b->hnext)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
 }
 
-void bucket_lock(uint bucket){
-    acquire(&bcache.bucket_lock[bucket]);
+// Caller holds the block's stripe lock.
+static void
+hremove(struct buf *b, uint h)
+{
+  struct buf **bp;
+
+  for(bp = &bcache.table[h & (bcache.nbucket-1)]; *bp != b; bp = &(*bp)->hnext)
+    ;
+  *bp = b->hnext;
 }
-void bucket_unlock(uint bucket){
-    release(&bcache.bucket_lock[bucket]);
+
+static void
+bufctor(void *obj)
+{
+  struct buf *b = (struct buf*)obj;
+
+  initsleeplock(&b->lock, "buffer");
 }
+
 void
 binit(void)
 {
+  initlock(&bcache.lock, "bcache");
+  for (int i = 0; i < NSTRIPE; ++i) {
+      initlock(&bcache.stripe[i], "bcache.bucket");
+  }
+  bcache.cache = kmem_cache_create("buf", sizeof(struct buf), bufctor, 0);
+
+  bcache.cold.prev = bcache.cold.next = &bcache.cold;
+  bcache.hot.prev = bcache.hot.next = &bcache.hot;
 
-  for (int i = 0; i < NBUCKET; ++i) {
-      initlock(&bcache.lock[i], "bcache.lock");
-      initlock(&bcache.bucket_lock[i], "bcache.bucket");
+  if((bcache.table = kalloc_pages(0)) == 0)
+    panic("binit");
+  memset(bcache.table, 0, PGSIZE);
+  bcache.nbucket = PGSIZE / sizeof(struct buf*);
+  bcache.order = 0;
+}
+
+// Take b out of the hash table, unless somebody is using it.
+// Caller holds bcache.lock.
+static int
+bclaim(struct buf *b)
+{
+  uint h = bhash(b->dev, b->blockno);
+  struct spinlock *lk = bstripe(h);
+
+  acquire(lk);
+  if(b->refcnt != 0){
+    release(lk);
+    return 0;
   }
+  hremove(b, h);
+  release(lk);
+  return 1;
+}
 
+// Recycle the oldest unused buffer on the cold queue,
+// remembering its block on the ghost list.
+// Caller holds bcache.lock.
+static struct buf*
+bevict_cold(void)
+{
+  struct buf *b;
 
-  // Create linked list of buffers
-  for (int i = 0; i < NBUCKET; ++i) {
-      bcache.head[i].prev = &bcache.head[i];
-      bcache.head[i].next = &bcache.head[i];
+  for(b = bcache.cold.prev; b != &bcache.cold; b = b->prev){
+    if(bclaim(b)){
+      qremove(b);
+      bcache.ncold--;
+      bcache.ghost[bcache.ghostpos] = bkey(b->dev, b->blockno);
+      bcache.ghostpos = (bcache.ghostpos + 1) % NGHOST;
+      return b;
+    }
   }
-  for (int i = 0; i < NBUCKET; ++i) {
-      bcache.unused_buf[i].prev=&bcache.unused_buf[i];
-      bcache.unused_buf[i].next=&bcache.unused_buf[i];
+  return 0;
+}
+
+// Pick an unused buffer to recycle and take it out of the
+// hash table and its queue. The cold queue goes first while
+// it holds more than a quarter of the buffers; hot buffers
+// get a second chance if referenced since the hand last
+// passed. Returns 0 if every buffer is in use.
+// Caller holds bcache.lock.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  struct spinlock *lk;
+  int ref;
+
+  if(bcache.ncold > bcache.nbuf/4 || bcache.nhot == 0)
+    if((b = bevict_cold()) != 0)
+      return b;
+
+  for(int n = 2*bcache.nhot; n > 0; n--){
+    b = bcache.hot.prev;
+    qremove(b);
+    lk = bstripe(bhash(b->dev, b->blockno));
+    acquire(lk);
+    ref = b->ref;
+    b->ref = 0;
+    release(lk);
+    if(ref == 0 && bclaim(b)){
+      bcache.nhot--;
+      return b;
+    }
+    qpush(&bcache.hot, b);
   }
+  return bevict_cold();
+}
+
+// Free a buffer that bevict() returned.
+// Caller holds bcache.lock.
+static void
+bfree(struct buf *b)
+{
+  bcache.nbuf--;
+  kmem_cache_free(bcache.cache, b);
+}
 
-  for (int i = 0; i < NBUF; ++i) {
-      unused_insert(&bcache.buf[i]);
-      initsleeplock(&bcache.buf[i].lock, "buffer");
+// Keep the hash table between half and twice the number
+// of buffers. Caller holds bcache.lock.
+static void
+bresize(void)
+{
+  struct buf **table, **old, *b, *next;
+  uint n, oldn;
+  int order, oldorder;
+
+  order = bcache.order;
+  if(bcache.nbuf > 2*bcache.nbucket && order < MAXORDER)
+    order++;
+  else if(bcache.nbuf < bcache.nbucket/2 && order > 0)
+    order--;
+  else
+    return;
+  if((table = kalloc_pages(order)) == 0)
+    return;
+  memset(table, 0, PGSIZE << order);
+  n = (PGSIZE << order) / sizeof(struct buf*);
+
+  for (int i = 0; i < NSTRIPE; ++i) {
+      acquire(&bcache.stripe[i]);
+  }
+  old = bcache.table;
+  oldn = bcache.nbucket;
+  oldorder = bcache.order;
+  for(uint i = 0; i < oldn; i++){
+    for(b = old[i]; b; b = next){
+      next = b->hnext;
+      b->hnext = table[bhash(b->dev, b->blockno) & (n-1)];
+      table[bhash(b->dev, b->blockno) & (n-1)] = b;
+    }
+  }
+  bcache.table = table;
+  bcache.nbucket = n;
+  bcache.order = order;
+  for (int i = NSTRIPE-1; i >= 0; --i) {
+      release(&bcache.stripe[i]);
+  }
+  kfree_pages(old, oldorder);
+}
+
+// Find a buffer for a block that is not cached: a new one
+// while memory is plentiful, otherwise a recycled one, or a
+// new one after all if every buffer is in use. When memory
+// runs low, also give one more buffer back, so that the
+// cache shrinks.
+// Caller holds bcache.lock.
+static struct buf*
+balloc(void)
+{
+  struct buf *b, *v;
+  uint64 nfree;
+
+  nfree = kfreepages();
+  if(bcache.nbuf < NBUF || nfree > BFREE_MIN){
+    if((b = kmem_cache_alloc(bcache.cache)) != 0){
+      bcache.nbuf++;
+      return b;
+    }
   }
+  if((b = bevict()) == 0){
+    // all pinned, by the log say: grow while memory lasts.
+    if((b = kmem_cache_alloc(bcache.cache)) != 0)
+      bcache.nbuf++;
+    return b;
+  }
+  if(nfree < BFREE_MIN/2 && bcache.nbuf > NBUF && (v = bevict()) != 0)
+    bfree(v);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// For readahead, return 0 instead if the block is cached
+// already or no buffer is free; never sleep.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ra)
 {
   struct buf *b;
-  uint hash_bucket= hash(dev,blockno);
-  bucket_lock(hash_bucket);
+  uint h = bhash(dev, blockno);
+  struct spinlock *lk = bstripe(h);
+  uint64 key = bkey(dev, blockno);
 
   // Is the block already cached?
+  acquire(lk);
+  if((b = blookup(dev, blockno, h)) != 0){
+    if(ra){
+      release(lk);
+      return 0;
+    }
+    b->refcnt++;
+    b->ref = 1;
+    release(lk);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(lk);
 
-  for(b = bcache.head[hash_bucket].next; b != &bcache.head[hash_bucket]; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      bucket_unlock(hash_bucket);
-      acquiresleep(&b->lock);
-      return b;
+  // Not cached. Look again holding bcache.lock, since only
+  // misses insert blocks and another one may have just done so.
+  acquire(&bcache.lock);
+  acquire(lk);
+  if((b = blookup(dev, blockno, h)) != 0){
+    if(ra){
+      release(lk);
+      release(&bcache.lock);
+      return 0;
     }
+    b->refcnt++;
+    b->ref = 1;
+    release(lk);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-
-  b=unused_get(hash_bucket);
-  if(b){
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      bucket_insert(hash_bucket,b);
-      bucket_unlock(hash_bucket);
-      acquiresleep(&b->lock);
-      return b;
+  release(lk);
+
+  if((b = balloc()) == 0){
+    if(ra){
+      release(&bcache.lock);
+      return 0;
+    }
+    panic("bget: no buffers");
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->ref = 0;
+  // lock it before anyone else can find it, so that they wait
+  // for the contents. it is unused, so this cannot sleep.
+  acquiresleep(&b->lock);
+
+  // A block evicted from the cold queue that is wanted again
+  // is worth keeping: it goes straight to the hot queue.
+  int i;
+  for(i = 0; i < NGHOST; i++)
+    if(bcache.ghost[i] == key)
+      break;
+  if(i < NGHOST){
+    bcache.ghost[i] = 0;
+    qpush(&bcache.hot, b);
+    bcache.nhot++;
+  } else {
+    qpush(&bcache.cold, b);
+    bcache.ncold++;
   }
-  bucket_unlock(hash_bucket);
-  panic("bget: no buffers");
+
+  acquire(lk);
+  b->hnext = bcache.table[h & (bcache.nbucket-1)];
+  bcache.table[h & (bcache.nbucket-1)] = b;
+  release(lk);
+  bresize();
+  release(&bcache.lock);
+  return b;
+}
+
+// Called by kalloc() when it runs out of memory: free unused
+// buffers until up to n pages have gone back to kalloc().
+// A slab page is only freed once all of its buffers are, so
+// this may take several buffers per page. Returns the number
+// of pages freed.
+int
+bshrink(int n)
+{
+  struct buf *b;
+  int npage;
+
+  // kalloc() called on behalf of bget() itself.
+  if(holding(&bcache.lock))
+    return 0;
+
+  acquire(&bcache.lock);
+  npage = kmem_cache_shrink(bcache.cache);
+  while(npage < n && bcache.nbuf > NBUF){
+    if((b = bevict()) == 0)
+      break;
+    bfree(b);
+    npage += kmem_cache_shrink(bcache.cache);
+  }
+  bresize();
+  release(&bcache.lock);
+  return npage;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -169,25 +449,115 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    brw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Read n blocks of dev, returning them locked in bv. The
+// blocks that are not cached go to the disk as one batch,
+// which it can merge, and are waited for together. As with
+// several bread()s, the caller must hold the bufs in an
+// order that cannot deadlock with other holders.
+void
+breadv(uint dev, uint *blockno, int n, struct buf **bv)
+{
+  struct buf *miss[NBUF];
+  int nmiss = 0;
+
+  if(n > NBUF)
+    panic("breadv");
+  for(int i = 0; i < n; i++){
+    bv[i] = bget(dev, blockno[i], 0);
+    if(!bv[i]->valid){
+      bv[i]->done = 0;
+      miss[nmiss++] = bv[i];
+    }
+  }
+  if(nmiss == 0)
+    return;
+  bdev(dev)->submit(miss, nmiss, 0);
+  for(int i = 0; i < nmiss; i++){
+    bdev(dev)->wait(miss[i]);
+    miss[i]->valid = 1;
+  }
+}
+
+// Completion callback for breadahead(), run by the disk
+// interrupt: the data is valid, and the reader's lock and
+// reference go away.
+static void
+bdone(struct buf *b)
+{
+  struct spinlock *lk = bstripe(bhash(b->dev, b->blockno));
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+  acquire(lk);
+  b->refcnt--;
+  release(lk);
+}
+
+// Start reading a block into the cache without waiting for
+// the disk. Does nothing if the block is cached already or
+// no buffer is free right now.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return;
+  b->done = bdone;
+  bdev(dev)->submit(&b, 1, 0);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  brw(b, 1);
+}
+
+// Write n locked buffers, keeping all of the writes in
+// flight at once, and wait until they are on disk.
+void
+bwritev(struct buf **bv, int n)
+{
+  struct bdevsw *d;
+
+  if(n == 0)
+    return;
+  d = bdev(bv[0]->dev);
+  for(int i = 0; i < n; i++){
+    if(!holdingsleep(&bv[i]->lock) || bv[i]->dev != bv[0]->dev)
+      panic("bwritev");
+    bv[i]->done = 0;
+  }
+  d->submit(bv, n, 1);
+  for(int i = 0; i < n; i++)
+    d->wait(bv[i]);
+}
+
+// Make the writes to dev that have finished so far durable,
+// for devices that cache writes.
+void
+bflush(uint dev)
+{
+  struct bdevsw *d = bdev(dev);
+
+  if(d->flush)
+    d->flush();
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// It stays where it is in its queue; a later hit only
+// sets its reference bit.
 void
 brelse(struct buf *b)
 {
@@ -195,32 +565,25 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-  uint  hash_bucket=hash(b->dev,b->blockno);
-  bucket_lock(hash_bucket);
+  struct spinlock *lk = bstripe(bhash(b->dev, b->blockno));
+  acquire(lk);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    unused_insert(b);
-  }
-  bucket_unlock(hash_bucket);
+  release(lk);
 }
 
 void
 bpin(struct buf *b) {
-  uint  hash_bucket=hash(b->dev,b->blockno);
-  bucket_lock(hash_bucket);
+  struct spinlock *lk = bstripe(bhash(b->dev, b->blockno));
+  acquire(lk);
   b->refcnt++;
-  bucket_unlock(hash_bucket);
+  release(lk);
 }
 
 void
 bunpin(struct buf *b) {
-  uint  hash_bucket=hash(b->dev,b->blockno);
-  bucket_lock(hash_bucket);
+  struct spinlock *lk = bstripe(bhash(b->dev, b->blockno));
+  acquire(lk);
   b->refcnt--;
-  bucket_unlock(hash_bucket);
+  release(lk);
 }
 
-
@@ -1,12 +1,31 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  void (*done)(struct buf*); // completion callback, see virtio_disk.c
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uchar ref;        // used since the clock hand last passed
+  struct buf *hnext; // hash chain
+  struct buf *prev; // cold or hot queue
   struct buf *next;
+  struct buf *qnext; // disk queue, see virtio_disk.c
+  uint64 deadline;  // when the disk queue must send it
+  int write;        // queued as a write?
+  int vq;           // virtio queue it was submitted to
   uchar data[BSIZE];
 };
 
+// map a block device number to its driver.
+// a driver's submit(bv, n, write) starts reads or writes of n
+// locked buffers; each finishes by calling b->done(b) if set,
+// or else by waking up wait(b). see virtio_disk.c.
+struct bdevsw {
+  void (*submit)(struct buf**, int, int);
+  void (*wait)(struct buf*);
+  void (*flush)(void);      // make finished writes durable; may be 0
+};
+
+extern struct bdevsw bdevsw[];
+
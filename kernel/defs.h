@@ -2,6 +2,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -16,10 +17,15 @@ struct sock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
+void            breadv(uint, uint*, int, struct buf**);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bflush(uint);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
 
 // console.c
 void            consoleinit(void);
@@ -36,6 +42,7 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filesync(struct file*, int);
 int             filewrite(struct file*, uint64, int n);
 
 // fs.c
@@ -61,29 +68,31 @@ struct inode*   symlink(struct inode* ip, char *name);
 struct inode*   nameilink(struct inode* link_ip);
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
 
 // kalloc.c
-extern char end[]; // first address after kernel.
-// defined by kernel.ld.
-#define PGCOUNT     ((PHYSTOP-PGROUNDDOWN((uint64)end+PGSIZE))/PGSIZE)
-#define map(x)      ((PGROUNDDOWN((uint64)x)-PGROUNDUP((uint64)end+PGCOUNT))/PGSIZE)
-#define refcount(x) end[map((uint64)x)]
-#define inc_refcount(x) end[map((uint64)x)]++
-#define dec_refcount(x) end[map((uint64)x)]--
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_pages(int);
+void*           kalloc_zeroed(void);
+void            kfree_pages(void *, int);
+uint64          kfreepages(void);
 void            kinit(void);
-void            kreflock(void* pa);
-void            krefunlock(void* pa);
+void            krefinc(void *);
+void            kzeroinit(void);
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_write_data(struct buf*);
+void            log_free(uint);
+int             log_freed(uint);
 void            begin_op(void);
+void            begin_op_n(int, int);
 void            end_op(void);
+uint            log_tid(void);
+void            log_sync(uint);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -103,6 +112,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread_create(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -140,6 +150,13 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint, void (*)(void*), void (*)(void*));
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_shrink(struct kmem_cache*);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -199,6 +216,7 @@ void            proc_kstackinit(struct proc* p);
 void            proc_kvminithart(struct proc* p);
 uint64          proc_kvmpa(struct proc*p,uint64 va);
 void            proc_usermapping(struct proc* p, uint64 oldsz,uint64 newsz);
+void            vmainit(void);
 int             mmap_valid(struct proc* p,uint64 va);
 int             load_vma(struct proc* p,uint64 va,int index);
 int             copy(pagetable_t, pagetable_t, uint64,uint64);
@@ -218,7 +236,9 @@ void            plic_complete(int);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
+void            virtio_disk_flush(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
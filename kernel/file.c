@@ -15,14 +15,15 @@
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;      // protects ref in every file
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file), 0, 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +32,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,14 +65,13 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_op_n(OP_IPUT, 0);
     iput(ff.ip);
     end_op();
   }
@@ -101,6 +96,22 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Wait until the changes to file f are durable, or with
+// data set, those to its data and size.
+int
+filesync(struct file *f, int data)
+{
+  uint tid;
+
+  if(f->type != FD_INODE)
+    return -1;
+  ilock(f->ip);
+  tid = data ? f->ip->dtid : f->ip->tid;
+  iunlock(f->ip);
+  log_sync(tid);
+  return 0;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -146,20 +157,21 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // write MAXOPDATA blocks at a time to stay within
+    // what one transaction can hold. the data itself
+    // does not go through the log, only the i-node,
+    // extent blocks and allocation blocks do, which
+    // OP_WRITE allows for.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = MAXOPDATA * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_op_n(OP_WRITE, MAXOPDATA);
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
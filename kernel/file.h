@@ -20,24 +20,33 @@ struct file {
 #define minor(dev)  ((dev) & 0xFFFF)
 #define	mkdev(m,n)  ((uint)((m)<<16| (n)))
 
+#define NECACHE 8   // extents cached per inode
+
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // icache list, protected by icache.lock
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint ra_next;       // block after the last one read
+  uint ra_pos;        // block after the last one read ahead
+  uint ra_win;        // readahead window, 0 if not sequential
+  uint tid;           // log transaction of the last change
+  uint dtid;          // ... of the last change to its data
+  uint goal;          // where to allocate its next block
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-#ifdef SOL_FS
-  uint addrs[N_FILEADDR];
-#else
-  uint addrs[N_FILEADDR];
-#endif
+  struct exthdr eh;
+  struct extent ext[NEXTENT];
+  struct extent ecache[NECACHE]; // extents bmap() found in the tree
+  uint ecnext;        // ecache slot to fill next
 };
 
 // map major device number to device functions.
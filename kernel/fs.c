@@ -37,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int dev);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,43 +46,132 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
 }
 
-// Zero a block.
+// Zero a block, which will hold file data if data is set.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
   bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_write_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// balloc() keeps a count of the free blocks under each bitmap
+// block, so it only reads bitmap blocks that have some, and
+// allocates next-fit: each file's blocks go right after the
+// last block it got, and a file's first block goes at a
+// cursor, which then moves BGAP blocks further on to leave
+// room for the file to grow in place. Extent tree blocks go
+// at the cursor, without a gap. A block freed by the
+// open transaction is not allocated again until it closes:
+// its old owner still refers to it until the transaction
+// commits, and new file data is written in place before that.
+
+#define BGAP 32   // blocks left after the first block of a file
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+struct {
+  struct spinlock lock;
+  int nfree[FSSIZE/BPB+1];  // free blocks under each bitmap block
+  uint nbmap;               // bitmap blocks in use
+  uint cursor;              // where files start
+} bsum;
+
+// Count the free blocks. Called once the log is recovered.
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint b, bi;
 
-  bp = 0;
+  initlock(&bsum.lock, "bsum");
+  bsum.nbmap = (sb.size + BPB - 1) / BPB;
+  if(bsum.nbmap > NELEM(bsum.nfree))
+    panic("binit: file system too big");
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[b/BPB]++;
+    brelse(bp);
+  }
+  bsum.cursor = sb.bmapstart + sb.size/BPB + 1;  // the first data block
+}
+
+// Find a clear bit at or after bi in bitmap block bp, which
+// covers blocks from b on. Returns -1 if there is none.
+static int
+bfind(struct buf *bp, uint b, int bi)
+{
+  for(; bi < BPB && b + bi < sb.size; bi++){
+    if(bi % 8 == 0 && bp->data[bi/8] == 0xff){
+      bi += 7;  // a byte of blocks in use
+      continue;
     }
+    if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
+
+// Allocate a zeroed disk block for ip, for file data if data
+// is set, as close after ip's last one as possible. A block
+// for ip's extent tree (tree set) comes from the disk-wide
+// cursor instead, so that it does not split ip's next extent,
+// and without the gap left for a new file's start.
+static uint
+balloc(struct inode *ip, int data, int tree)
+{
+  uint goal, g, i, b;
+  int bi, first;
+  struct buf *bp;
+
+  acquire(&bsum.lock);
+  first = tree || ip->goal == 0 || ip->goal >= sb.size;
+  goal = first ? bsum.cursor : ip->goal;
+  release(&bsum.lock);
+
+  // from goal to the end of the disk, then around to goal.
+  for(i = 0; i <= bsum.nbmap; i++){
+    g = (goal/BPB + i) % bsum.nbmap;
+    if(bsum.nfree[g] == 0)   // only a hint; checked below
+      continue;
+    bp = bread(ip->dev, sb.bmapstart + g);
+    bi = bfind(bp, g*BPB, i == 0 ? goal % BPB : 0);
+    while(bi >= 0 && log_freed(g*BPB + bi))
+      bi = bfind(bp, g*BPB, bi + 1);
+    if(bi < 0){
+      brelse(bp);
+      continue;
+    }
+    bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+    log_write(bp);
     brelse(bp);
+    b = g*BPB + bi;
+
+    acquire(&bsum.lock);
+    bsum.nfree[g]--;
+    if(first && !tree)
+      bsum.cursor = b + BGAP;
+    else if(b >= bsum.cursor)
+      bsum.cursor = b + 1;
+    if(bsum.cursor >= sb.size)
+      bsum.cursor = 0;
+    release(&bsum.lock);
+
+    if(!tree)
+      ip->goal = b + 1;
+    bzero(ip->dev, b, data);
+    return b;
   }
   panic("balloc: out of blocks");
 }
@@ -100,6 +191,11 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  log_free(b);
+
+  acquire(&bsum.lock);
+  bsum.nfree[b/BPB]++;
+  release(&bsum.lock);
 }
 
 // Inodes.
@@ -162,10 +258,16 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// In-memory inodes come from a slab cache and sit on the
+// icache.list while in use. Once ip->ref drops to zero an
+// inode stays cached, valid, until more than NINODE such
+// unreferenced inodes pile up; then it is freed.
+//
+// The icache.lock spin-lock protects the icache list and
+// the allocation of icache entries. Since ip->ref indicates
+// whether an entry is free, and ip->dev and ip->inum indicate
+// which i-node an entry holds, one must hold icache.lock while
+// using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -173,21 +275,28 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *list;  // every cached inode
+  int nidle;           // cached inodes with ref == 0
 } icache;
 
+static void
+inodector(void *obj)
+{
+  struct inode *ip = (struct inode*)obj;
+
+  initsleeplock(&ip->lock, "inode");
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kmem_cache_create("inode", sizeof(struct inode), inodector, 0);
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void ecache_clear(struct inode*);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -231,9 +340,11 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  dip->eh = ip->eh;
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
   log_write(bp);
   brelse(bp);
+  ip->tid = log_tid();
 }
 
 // Find the inode with number inum on device dev
@@ -242,31 +353,36 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.list; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        icache.nidle--;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  if((ip = kmem_cache_alloc(icache.cache)) == 0)
     panic("iget: no inodes");
-
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ra_next = ip->ra_pos = ip->ra_win = 0;
+  // changes from before it was cached may not be durable yet.
+  ip->tid = ip->dtid = log_tid();
+  ip->goal = 0;
+  ecache_clear(ip);
+  ip->prev = 0;
+  ip->next = icache.list;
+  if(icache.list)
+    icache.list->prev = ip;
+  icache.list = ip;
   release(&icache.lock);
 
   return ip;
@@ -304,7 +420,8 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->eh = dip->eh;
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -323,8 +440,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// kept idle or freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -354,6 +471,22 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0){
+    if(ip->valid && icache.nidle < NINODE){
+      // keep it cached for the next iget().
+      icache.nidle++;
+    } else {
+      if(ip->prev)
+        ip->prev->next = ip->next;
+      else
+        icache.list = ip->next;
+      if(ip->next)
+        ip->next->prev = ip->prev;
+      release(&icache.lock);
+      kmem_cache_free(icache.cache, ip);
+      return;
+    }
+  }
   release(&icache.lock);
 }
 
@@ -368,116 +501,326 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, mapped by the extent tree whose root
+// is ip->eh and ip->ext[] (see fs.h). Files only grow at the
+// end, so a new block either lengthens the last extent or
+// starts one after it, in the rightmost leaf of the tree.
+
+// The records that follow header h, in a tree block or in
+// the i-node.
+#define EXT(h) ((struct extent*)((h) + 1))
+
+// Index of the last of the n records in e that starts at or
+// before file block bn, or -1 if there is none.
+static int
+extfind(struct extent *e, int n, uint bn)
+{
+  int lo, hi, mid;
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+  if(n == 0 || bn < e[0].lblk)
+    return -1;
+  lo = 0;
+  hi = n - 1;
+  while(lo < hi){
+    mid = (lo + hi + 1) / 2;
+    if(e[mid].lblk <= bn)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Each inode caches the last NECACHE extents that bmap_lookup()
+// read from tree blocks: the one it was after and those that
+// follow it in the leaf. So sequential I/O on a big file only
+// reads its tree once every NECACHE extents, not for every
+// block. Cached extents stay right as the file grows, since
+// an extent only changes by getting longer, which bmap()
+// passes on; itrunc() empties the cache.
+
+static void
+ecache_clear(struct inode *ip)
+{
+  int i;
+
+  for(i = 0; i < NECACHE; i++)
+    ip->ecache[i].len = 0;
+  ip->ecnext = 0;
+}
+
+// Return the address of block bn of ip if a cached
+// extent maps it, or 0.
 static uint
-bmap(struct inode *ip, uint bn)
+ecache_lookup(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  struct extent *e;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
-  }
-  bn -= NDIRECT;
+  for(e = ip->ecache; e < &ip->ecache[NECACHE]; e++)
+    if(bn - e->lblk < e->len)
+      return e->pblk + (bn - e->lblk);
+  return 0;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[INDIRECT]) == 0)
-      ip->addrs[INDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
-    }
-    brelse(bp);
+static void
+ecache_add(struct inode *ip, struct extent *e)
+{
+  ip->ecache[ip->ecnext] = *e;
+  ip->ecnext = (ip->ecnext + 1) % NECACHE;
+}
+
+// Return the disk block address of the nth block in inode ip,
+// or 0 if there is no such block. Never allocates.
+static uint
+bmap_lookup(struct inode *ip, uint bn)
+{
+  struct exthdr *h = &ip->eh;
+  struct buf *bp = 0;
+  struct extent *e;
+  uint addr = 0;
+  int i, j;
+
+  if(h->depth > 0 && (addr = ecache_lookup(ip, bn)) != 0)
     return addr;
-  }
-  bn-= NINDIRECT;
-  if(bn < NDOUBLE){
-      if((addr = ip->addrs[DOUBLE]) == 0)
-          ip->addrs[DOUBLE] = addr = balloc(ip->dev);
-      bp = bread(ip->dev, addr);
-      a = (uint*)bp->data;
-      uint cn=bn/NINDIRECT;
-      uint dn=bn%NINDIRECT;
-      if((addr = a[cn])==0){
-          a[cn]=addr= balloc(ip->dev);
-          log_write(bp);
-      }
-      brelse(bp);
-      bp = bread(ip->dev, addr);
-      a = (uint*)bp->data;
-      if((addr=a[dn])==0){
-          a[dn]=addr= balloc(ip->dev);
-          log_write(bp);
+  while((i = extfind(EXT(h), h->n, bn)) >= 0){
+    e = &EXT(h)[i];
+    if(h->depth == 0){
+      if(bn - e->lblk < e->len){
+        addr = e->pblk + (bn - e->lblk);
+        // cache it and the extents after it in the leaf,
+        // which a sequential reader will want next.
+        if(bp)
+          for(j = i; j < h->n && j < i + NECACHE; j++)
+            ecache_add(ip, &EXT(h)[j]);
       }
+      break;
+    }
+    addr = e->pblk;
+    if(bp)
       brelse(bp);
-      return addr;
+    bp = bread(ip->dev, addr);
+    h = (struct exthdr*)bp->data;
+    addr = 0;
   }
+  if(bp)
+    brelse(bp);
+  return addr;
+}
+
+// The rightmost path through an extent tree: h[0] is the
+// root, in the i-node, and h[depth] the last leaf. Tree
+// blocks stay held in bp[] until extrelse().
+struct extpath {
+  int depth;
+  struct exthdr *h[EXTDEPTH+1];
+  struct buf *bp[EXTDEPTH+1];
+};
 
-  panic("bmap: out of range");
+static void
+extpath(struct inode *ip, struct extpath *p)
+{
+  struct exthdr *h;
+  int l;
+
+  p->depth = ip->eh.depth;
+  if(p->depth > EXTDEPTH)
+    panic("extpath: depth");
+  p->h[0] = &ip->eh;
+  p->bp[0] = 0;
+  for(l = 1; l <= p->depth; l++){
+    h = p->h[l-1];
+    p->bp[l] = bread(ip->dev, EXT(h)[h->n-1].pblk);
+    p->h[l] = (struct exthdr*)p->bp[l]->data;
+  }
 }
 
-// Truncate inode (discard contents).
-// Caller must hold ip->lock.
-void
-itrunc(struct inode *ip)
+static void
+extrelse(struct extpath *p)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int l;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  for(l = 1; l <= p->depth; l++)
+    brelse(p->bp[l]);
+}
+
+static void
+setext(struct extent *e, uint lblk, uint pblk, uint len)
+{
+  e->lblk = lblk;
+  e->pblk = pblk;
+  e->len = len;
+}
+
+// Add a record for file block bn, at disk block b, to the
+// tree, adding tree blocks as needed. The i-node's part of
+// the tree is written by the caller's iupdate().
+static void
+extinsert(struct inode *ip, uint bn, uint b)
+{
+  struct extpath p;
+  struct exthdr *h;
+  struct buf *nbp;
+  uint child, nb;
+  int k, l;
+
+  for(;;){
+    extpath(ip, &p);
+    // the lowest node on the path with room for a record.
+    for(k = p.depth; k >= 0; k--)
+      if(p.h[k]->n < (k == 0 ? NEXTENT : NEXTBLK))
+        break;
+    if(k >= 0)
+      break;
+
+    // the root is full: move its records into a new block
+    // below it, and try again with one more level.
+    if(p.depth == EXTDEPTH)
+      panic("extinsert: tree full");
+    nb = balloc(ip, 0, 1);
+    nbp = bread(ip->dev, nb);
+    memmove(nbp->data, &ip->eh, sizeof(ip->eh) + sizeof(ip->ext));
+    log_write(nbp);
+    brelse(nbp);
+    extrelse(&p);
+    ip->eh.depth++;
+    ip->eh.n = 1;
+    setext(&ip->ext[0], ip->ext[0].lblk, nb, 0);
   }
 
-  if(ip->addrs[INDIRECT]){
-    bp = bread(ip->dev, ip->addrs[INDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[INDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  // below node k, hang a new branch that maps just bn.
+  child = b;
+  for(l = p.depth; l > k; l--){
+    nb = balloc(ip, 0, 1);
+    nbp = bread(ip->dev, nb);
+    h = (struct exthdr*)nbp->data;
+    h->depth = p.depth - l;
+    h->n = 1;
+    setext(&EXT(h)[0], bn, child, l == p.depth);
+    log_write(nbp);
+    brelse(nbp);
+    child = nb;
   }
-  struct buf* bp1;
-  uint* b;
-  if(ip->addrs[DOUBLE]){
-      bp= bread(ip->dev,ip->addrs[DOUBLE]);
-      a = (uint*)bp->data;
-      //free all double block
-      for (i = 0; i < INDIRECT; ++i) {
-          if(a[i]){
-              bp1= bread(ip->dev,a[i]);
-              b=(uint*)bp1->data;
-              for (int j= 0; j < INDIRECT; ++j) {
-                  if(b[j]){
-                      bfree(ip->dev,b[j]);
-                  }
-              }
-              bfree(ip->dev,a[i]);
-          }
-      }
+  h = p.h[k];
+  setext(&EXT(h)[h->n++], bn, child, k == p.depth);
+  if(k > 0)
+    log_write(p.bp[k]);
+  extrelse(&p);
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, which must
+// be the block after the file's last.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  struct extpath p;
+  struct exthdr *h;
+  struct extent *e;
+  uint addr;
+  int i;
+
+  if((addr = bmap_lookup(ip, bn)) != 0)
+    return addr;
+
+  extpath(ip, &p);
+  h = p.h[p.depth];
+  e = h->n > 0 ? &EXT(h)[h->n-1] : 0;  // the last extent
+  if(bn != (e ? e->lblk + e->len : 0))
+    panic("bmap: hole");
+  if(ip->goal == 0 && e)
+    ip->goal = e->pblk + e->len;
+  addr = balloc(ip, ip->type == T_FILE, 0);
+  if(e && e->pblk + e->len == addr){
+    e->len++;
+    for(i = 0; i < NECACHE; i++)
+      if(ip->ecache[i].len > 0 && ip->ecache[i].lblk == e->lblk)
+        ip->ecache[i].len = e->len;
+    if(p.depth > 0)
+      log_write(p.bp[p.depth]);
+    extrelse(&p);
+  } else {
+    extrelse(&p);
+    extinsert(ip, bn, addr);
+  }
+  return addr;
+}
+
+// Sequential readahead. readi() calls this before reading
+// blocks first..last of ip. If the read carries on where the
+// previous one stopped, the blocks after it are read into the
+// buffer cache in the background: once the reader is within
+// half a window of the last block started, another window is
+// started, and the window doubles up to RAMAX blocks. Any
+// other access pattern turns readahead off until the reads
+// become sequential again.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, addr;
+
+  if(first != ip->ra_next && first + 1 != ip->ra_next){
+    ip->ra_win = 0;
+    ip->ra_pos = 0;
+    ip->ra_next = last + 1;
+    return;
+  }
+  ip->ra_next = last + 1;
+  if(ip->ra_pos <= last)
+    ip->ra_pos = last + 1;
+  if(ip->ra_win == 0)
+    ip->ra_win = RAMIN;
+  else if(ip->ra_pos - (last + 1) >= ip->ra_win / 2)
+    return;
+
+  end = last + 1 + ip->ra_win;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  for(bn = ip->ra_pos; bn < end; bn++)
+    if((addr = bmap_lookup(ip, bn)) != 0)
+      breadahead(ip->dev, addr);
+  if(end > ip->ra_pos)
+    ip->ra_pos = end;
+  if(ip->ra_win < RAMAX)
+    ip->ra_win *= 2;
+}
+
+// Free the blocks mapped by the extent tree node h,
+// and the tree blocks below it.
+static void
+extfree(struct inode *ip, struct exthdr *h)
+{
+  struct extent *e;
+  struct buf *bp;
+  uint j;
+  int i;
+
+  for(i = 0; i < h->n; i++){
+    e = &EXT(h)[i];
+    if(h->depth == 0){
+      for(j = 0; j < e->len; j++)
+        bfree(ip->dev, e->pblk + j);
+    } else {
+      bp = bread(ip->dev, e->pblk);
+      extfree(ip, (struct exthdr*)bp->data);
       brelse(bp);
-      bfree(ip->dev, ip->addrs[DOUBLE]);
-      ip->addrs[DOUBLE] = 0;
+      bfree(ip->dev, e->pblk);
+    }
   }
+}
 
+// Truncate inode (discard contents).
+// Caller must hold ip->lock.
+void
+itrunc(struct inode *ip)
+{
+  extfree(ip, &ip->eh);
+  ecache_clear(ip);
+  ip->eh.n = 0;
+  ip->eh.depth = 0;
   ip->size = 0;
   iupdate(ip);
+  ip->dtid = ip->tid;
 }
 
 // Copy stat information from inode.
@@ -506,6 +849,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0 && ip->type == T_FILE)
+    readahead(ip, off/BSIZE, (off + n - 1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -545,7 +890,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_write_data(bp);   // file data bypasses the log
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -554,8 +902,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip->ext[].
   iupdate(ip);
+  ip->dtid = ip->tid;
 
   return tot;
 }
@@ -20,21 +20,41 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_*
 };
 
 #define FSMAGIC 0x10203040
+#define FS_ASYNC 0x1       // commit transactions in the background
 
-#define NDIRECT 11
-#define INDIRECT NDIRECT
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define DOUBLE  INDIRECT+1
-#define NDOUBLE (BSIZE / sizeof(uint))*(BSIZE / sizeof(uint))
-#define N_FILEADDR DOUBLE+1
+// A file's blocks are mapped by extents, each a run of file
+// blocks stored in consecutive disk blocks. The i-node holds
+// NEXTENT records; when those are not enough, they become the
+// root of a tree of extent blocks, each a header followed by
+// NEXTBLK records. In a node of depth 0 the records are
+// extents; above that, each record points at a node one level
+// down that maps the file blocks from its lblk on.
+#define NEXTENT  4
+#define NEXTBLK  ((BSIZE - sizeof(struct exthdr)) / sizeof(struct extent))
+#define EXTDEPTH 4    // max depth of an extent tree
+
+// The limits of the old block map, which tests rely on.
 #ifdef LAB_FS
-#define MAXFILE (NDIRECT + NINDIRECT + NDOUBLE)
+#define MAXFILE (11 + 256 + 256*256)
 #else
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (11 + 256)
 #endif
+
+struct exthdr {
+  ushort n;             // records in use
+  ushort depth;         // 0 if the records are extents
+};
+
+struct extent {
+  uint lblk;            // first file block mapped
+  uint pblk;            // its disk block, or the node below
+  uint len;             // number of blocks (depth 0 only)
+};
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -42,7 +62,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[N_FILEADDR];   // Data block addresses
+  struct exthdr eh;     // Extent tree root
+  struct extent ext[NEXTENT];
 };
 
 // Inodes per block.
@@ -57,6 +78,21 @@ struct dinode {
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) ((b)/BPB + sb.bmapstart)
 
+// Log blocks an FS operation may write, for begin_op_n().
+// Adding up to NEXTBLK extents to a file writes the tree blocks
+// on the rightmost path, a new branch of up to EXTDEPTH blocks
+// below it, and a block for the old root if the tree gets a
+// level. Growing a file or directory also writes its i-node and
+// up to 3 bitmap blocks: 2 for data blocks after the file's goal,
+// which may cross into the next bitmap block, and 1 for tree
+// blocks, which come from the disk-wide cursor.
+#define OP_EXTENT (2*EXTDEPTH + 1)
+#define OP_GROW   (OP_EXTENT + 3 + 1)  // growing by up to NEXTBLK blocks
+#define OP_IPUT   (1 + FSSIZE/BPB + 1) // dropping an i-node, which may free it
+#define OP_DIRENT (1 + OP_GROW)        // a directory entry, growing the directory
+#define OP_CREATE (1 + OP_DIRENT + 2)  // a new i-node, its entry, a new directory's first block
+#define OP_WRITE  OP_GROW              // MAXOPDATA blocks of file data
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -1,6 +1,7 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
 
 #include "types.h"
 #include "param.h"
@@ -18,45 +19,256 @@ struct run {
   struct run *next;
 };
 
+// Per-CPU page caches. A CPU allocates from and frees to its
+// own cache; pages move to and from the buddy allocator (the
+// shared depot) KBATCH at a time. A cache's lock is only ever
+// contended when another CPU, finding the depot empty, steals
+// half of its pages, or when kzerod tops up its zeroed pool.
+#define KMAG   64          // pages a CPU cache may hold
+#define KBATCH (KMAG/2)    // pages moved per refill or drain
+#define KZERO  16          // pre-zeroed pages kzerod keeps per CPU
+
+struct kcache {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  struct run *zero;        // zero-filled apart from the link word
+  int nz;
+};
+
 struct {
-  struct spinlock lock[NCPU];
-  struct spinlock reflock[NCPU];
-  struct run *freelist[NCPU];
+  struct kcache cache[NCPU];
 } kmem;
-#define cpu_map(addr) (((uint64)addr/PGSIZE)%NCPU)
-//#define cpu_map(addr) 0
-void
-kreflock(void* pa){
-    acquire(&kmem.reflock[cpu_map(pa)]);
+
+// Buddy allocator underneath the per-CPU caches.
+// Free memory is kept as blocks of 2^order pages, each
+// aligned to its own size (relative to KERNBASE). Freeing
+// a block merges it with its buddy whenever the buddy is
+// also free at the same order.
+#define NPAGE       ((PHYSTOP-KERNBASE)/PGSIZE)
+#define pa2idx(pa)  (((uint64)(pa)-KERNBASE)/PGSIZE)
+#define idx2pa(i)   ((void*)(KERNBASE+(uint64)(i)*PGSIZE))
+
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1]; // list heads, one per order
+  uint64 nfree;                  // number of free pages
+} buddy;
+
+// Per-page metadata, indexed by physical page number.
+// ref counts the page tables (or kernel users) sharing a
+// kalloc()ed page for copy-on-write. It is only updated
+// with atomic memory operations, so no lock guards it.
+struct page {
+  uint ref;
+  uchar order;   // order+1 if the page heads a free buddy block
+};
+
+struct page pages[NPAGE];
+
+#define pa2page(pa) (&pages[pa2idx(pa)])
+
+static void
+block_push(struct block *head, struct block *b)
+{
+  b->next = head->next;
+  b->prev = head;
+  head->next->prev = b;
+  head->next = b;
 }
-void
-krefunlock(void* pa){
-    release(&kmem.reflock[cpu_map(pa)]);
+
+static void
+block_remove(struct block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+// Return a block of 2^order pages to the free lists,
+// coalescing with free buddies. Caller holds buddy.lock.
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 i = pa2idx(pa);
+
+  buddy.nfree += 1L << order;
+  while(order < MAXORDER){
+    uint64 b = i ^ (1L << order);
+    if(b >= NPAGE || pages[b].order != order+1)
+      break;
+    pages[b].order = 0;
+    block_remove((struct block*)idx2pa(b));
+    i &= ~(1L << order);
+    order++;
+  }
+  pages[i].order = order+1;
+  block_push(&buddy.free[order], (struct block*)idx2pa(i));
+}
+
+// Take a block of 2^order pages off the free lists, splitting
+// a larger block if needed. Caller holds buddy.lock.
+static void*
+buddy_alloc(int order)
+{
+  struct block *b;
+  uint64 i;
+  int o;
+
+  for(o = order; o <= MAXORDER; o++)
+    if(buddy.free[o].next != &buddy.free[o])
+      break;
+  if(o > MAXORDER)
+    return 0;
+
+  b = buddy.free[o].next;
+  block_remove(b);
+  i = pa2idx(b);
+  pages[i].order = 0;
+  // hand the upper halves back until the block is small enough.
+  while(o > order){
+    o--;
+    pages[i + (1L << o)].order = o+1;
+    block_push(&buddy.free[o], (struct block*)idx2pa(i + (1L << o)));
+  }
+  buddy.nfree -= 1L << order;
+  return (void*)b;
 }
+
 void
 kinit()
 {
   for (int i = 0; i < NCPU; ++i) {
-      initlock(&kmem.lock[i], "kmem");
-      initlock(&kmem.reflock[i], "kmem.refcount");
+      initlock(&kmem.cache[i].lock, "kmem");
   }
-  char *ptr=end+PGCOUNT;
-  while (ptr!=end){
-      kreflock(ptr);
-      *ptr=1;
-      krefunlock(ptr);
-      ptr--;
+  initlock(&buddy.lock, "kmem.buddy");
+  for (int i = 0; i <= MAXORDER; ++i) {
+      buddy.free[i].next = buddy.free[i].prev = &buddy.free[i];
   }
-  freerange(end+PGCOUNT, (void*)PHYSTOP);
+  freerange(end, (void*)PAGETOP);
 }
 
+// Hand [pa_start, pa_end) to the buddy allocator as the largest
+// aligned blocks that fit. Only for use at boot: it takes no
+// locks and never touches the pages themselves, which are
+// zeroed lazily by kzerod or kalloc_zeroed().
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 i, n;
+  int o;
+
+  i = pa2idx(PGROUNDUP((uint64)pa_start));
+  n = pa2idx(PGROUNDDOWN((uint64)pa_end));
+  while(i < n){
+    for(o = MAXORDER; o > 0; o--)
+      if((i & ((1L << o) - 1)) == 0 && i + (1L << o) <= n)
+        break;
+    pages[i].order = o+1;
+    block_push(&buddy.free[o], (struct block*)idx2pa(i));
+    buddy.nfree += 1L << o;
+    i += 1L << o;
+  }
+}
+
+// Free a list of pages to the buddy allocator.
+static void
+kput(struct run *r)
+{
+  struct run *next;
+
+  if(r == 0)
+    return;
+  acquire(&buddy.lock);
+  for(; r; r = next){
+    next = r->next;
+    buddy_free(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Move every page parked in the per-CPU caches back into the
+// buddy allocator, so that they can coalesce again.
+static void
+kdrain(void)
+{
+  struct kcache *c;
+  struct run *r, *z;
+
+  for(c = kmem.cache; c < &kmem.cache[NCPU]; c++){
+    acquire(&c->lock);
+    r = c->list;
+    c->list = 0;
+    c->n = 0;
+    z = c->zero;
+    c->zero = 0;
+    c->nz = 0;
+    release(&c->lock);
+    kput(r);
+    kput(z);
+  }
+}
+
+// Number of free pages, including those parked in the
+// per-CPU caches. Only a snapshot: nothing is locked.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+
+  n = buddy.nfree;
+  for(int i = 0; i < NCPU; i++)
+    n += kmem.cache[i].n + kmem.cache[i].nz;
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if no such block is available.
+// The pages carry no COW reference count; release them
+// with kfree_pages() using the same order.
+void *
+kalloc_pages(int order)
+{
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  acquire(&buddy.lock);
+  pa = buddy_alloc(order);
+  release(&buddy.lock);
+  if(pa == 0 && order > 0){
+    kdrain();
+    acquire(&buddy.lock);
+    pa = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+  return pa;
+}
+
+// Take another reference to a kalloc()ed page, which
+// kfree() will then have to drop before the page is freed.
+void
+krefinc(void *pa)
+{
+  if(__sync_fetch_and_add(&pa2page(pa)->ref, 1) == 0)
+    panic("krefinc");
+}
+
+// Free a block obtained from kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
 }
 
 // Free the page of physical memory pointed at by v,
@@ -66,59 +278,136 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
-//  printf("kfree %p\n",pa);
+  struct kcache *c;
+  struct run *r, *batch;
+  uint ref;
+
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
-  kreflock(pa);
-  dec_refcount(pa);
-  if(refcount(pa)!=0){
-      krefunlock(pa);
-      return;
-  }
-  krefunlock(pa);
+  ref = __sync_fetch_and_sub(&pa2page(pa)->ref, 1);
+  if(ref == 0)
+    panic("kfree: page not allocated");
+  if(ref > 1)
+    return;
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
-//  printf("cpuid=%d\n", cpu_map(pa));
-  acquire(&kmem.lock[cpu_map(pa)]);
-  r->next = kmem.freelist[cpu_map(pa)];
-  kmem.freelist[cpu_map(pa)] = r;
-  release(&kmem.lock[cpu_map(pa)]);
-}
-void * kget(int cpuid){
-    struct run*r=0;
-    acquire(&kmem.lock[cpuid]);
-    r = kmem.freelist[cpuid];
-    if(r)
-        kmem.freelist[cpuid] = r->next;
-    release(&kmem.lock[cpuid]);
-    return r;
+  batch = 0;
+  push_off();
+  c = &kmem.cache[cpuid()];
+  acquire(&c->lock);
+  r->next = c->list;
+  c->list = r;
+  c->n++;
+  if(c->n > KMAG){
+    // cache overflowed: hand a batch back to the depot.
+    batch = c->list;
+    for(int i = 1; i < KBATCH; i++)
+      r = r->next;
+    c->list = r->next;
+    r->next = 0;
+    c->n -= KBATCH;
+  }
+  release(&c->lock);
+  pop_off();
+  kput(batch);
 }
-void *
-ksteal(int cpuid){
-    struct run *r=0;
-    int i=cpuid+1;
-    for (; i !=cpuid ; ++i) {
-        if(i==NCPU){
-//            printf("reset to zero");
-            i=0;
-            if(i==cpuid){
-                break;
-            }
-        }
-        r= kget(i);
-        if(r){
-//            printf("steal from cpu %d\n",i);
-            break;
-        }
+
+// Take up to KBATCH pages from the depot, or failing that,
+// half of the pages cached by some other CPU, or failing
+// that, a page from a zeroed pool.
+// Returns a list of pages and sets *np to its length.
+static struct run*
+krefill(int id, int *np)
+{
+  struct run *list, *r;
+  struct kcache *v;
+  int n, take;
+
+  list = 0;
+  n = 0;
+  acquire(&buddy.lock);
+  while(n < KBATCH && (r = buddy_alloc(0)) != 0){
+    r->next = list;
+    list = r;
+    n++;
+  }
+  release(&buddy.lock);
+
+  for(int i = 1; n == 0 && i < NCPU; i++){
+    v = &kmem.cache[(id + i) % NCPU];
+    acquire(&v->lock);
+    take = (v->n + 1) / 2;
+    for(; n < take; n++){
+      r = v->list;
+      v->list = r->next;
+      r->next = list;
+      list = r;
+    }
+    v->n -= take;
+    release(&v->lock);
+  }
+
+  // last resort: pages that kzerod set aside, on any CPU.
+  for(int i = 0; n == 0 && i < NCPU; i++){
+    v = &kmem.cache[(id + i) % NCPU];
+    acquire(&v->lock);
+    if((r = v->zero) != 0){
+      v->zero = r->next;
+      v->nz--;
+      r->next = 0;
+      list = r;
+      n = 1;
+    }
+    release(&v->lock);
+  }
+  *np = n;
+  return list;
+}
+
+// Take a page from this CPU's cache, refilling it if empty.
+static struct run*
+kpop(void)
+{
+  struct kcache *c;
+  struct run *r, *list;
+  int id, n;
+
+  push_off();
+  id = cpuid();
+  c = &kmem.cache[id];
+  acquire(&c->lock);
+  r = c->list;
+  if(r){
+    c->list = r->next;
+    c->n--;
+  }
+  release(&c->lock);
+  if(r == 0){
+    // refill without holding our own lock, so that two CPUs
+    // stealing from each other cannot deadlock.
+    list = krefill(id, &n);
+    if(list){
+      r = list;
+      acquire(&c->lock);
+      if(n > 1){
+        struct run *last = list->next;
+        while(last->next)
+          last = last->next;
+        last->next = c->list;
+        c->list = list->next;
+        c->n += n - 1;
+      }
+      release(&c->lock);
     }
-//    if(i==cpuid){
-//        printf("out of mem\n");
-//    }
-    return r;
+  }
+  pop_off();
+  return r;
 }
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -126,17 +415,84 @@ void *
 kalloc(void)
 {
   struct run *r;
+
+  // out of pages: have the buffer cache give some back.
+  while((r = kpop()) == 0)
+    if(bshrink(KBATCH) == 0)
+      break;
+
+  if(r){
+    pa2page(r)->ref = 1;
+#ifdef KJUNK
+    memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+// Allocate one zero-filled page, preferably from this CPU's
+// pool of pages that kzerod has already cleared.
+void *
+kalloc_zeroed(void)
+{
+  struct kcache *c;
+  struct run *r;
+
   push_off();
-  uint64 id=cpuid();
-  r= kget(id);
-  if(!r)
-      r= ksteal(id);
+  c = &kmem.cache[cpuid()];
+  acquire(&c->lock);
+  r = c->zero;
+  if(r){
+    c->zero = r->next;
+    c->nz--;
+  }
+  release(&c->lock);
   pop_off();
-  kreflock(r);
-  if(r)
-      inc_refcount(r);
-  krefunlock(r);
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+
+  if(r == 0){
+    if((r = kalloc()) != 0)
+      memset((char*)r, 0, PGSIZE);
+    return (void*)r;
+  }
+  r->next = 0;
+  pa2page(r)->ref = 1;
   return (void*)r;
 }
+
+// Background worker that keeps every CPU's zeroed pool topped
+// up, so page faults and page-table allocations need not clear
+// memory themselves. It only uses pages the depot can spare,
+// and wakes up once per clock tick.
+static void
+kzerod(void)
+{
+  struct kcache *c;
+  struct run *r;
+
+  for(;;){
+    for(c = kmem.cache; c < &kmem.cache[NCPU]; c++){
+      while(c->nz < KZERO && buddy.nfree > KBATCH){
+        acquire(&buddy.lock);
+        r = buddy_alloc(0);
+        release(&buddy.lock);
+        if(r == 0)
+          break;
+        memset((char*)r, 0, PGSIZE);
+        acquire(&c->lock);
+        r->next = c->zero;
+        c->zero = r;
+        c->nz++;
+        release(&c->lock);
+      }
+    }
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
+
+void
+kzeroinit(void)
+{
+  kthread_create(kzerod, "kzerod");
+}
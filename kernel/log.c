@@ -6,50 +6,170 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// calls. A transaction only closes when it has no FS system
+// calls active. Thus there is never any reasoning required
+// about whether a commit might write an uncommitted system
+// call's updates to disk.
 //
-// A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// A system call should call begin_op_n()/end_op() to mark
+// its start and end, telling begin_op_n() how many log blocks
+// and file data blocks it may write (see OP_* in fs.h);
+// begin_op() assumes the worst. Usually begin_op_n() just
+// reserves that space in the open transaction and returns.
+// But if the open transaction does not have the space left,
+// or has been open for COMMIT_TICKS, begin_op_n() closes it
+// to new calls and sleeps until it has committed. So the
+// closer the estimates, the more calls share a commit.
+//
+// Commits are pipelined with the next transaction. Closing a
+// transaction copies its blocks into snapshot buffers outside
+// the cache, which only takes a moment; the disk writes happen
+// from the snapshots, while a new transaction accepts calls
+// and changes the cached blocks. The last end_op() of a
+// transaction does the commit if no commit is running; if one
+// is, whoever is running it goes on to commit the next
+// transaction once it is done, so transactions that finish
+// during a commit are grouped into the next one.
+//
+// File data does not go through the log (ordered mode). The
+// file data blocks a transaction writes, which it records with
+// log_write_data(), are snapshotted along with its logged blocks
+// and written in place, and flushed, before any of its log
+// blocks are written. So a committed transaction never refers
+// to data that is not on disk. A block that still has a logged
+// version waiting for a checkpoint must not be overwritten in
+// place, or the checkpoint or a recovery would later put the
+// old contents back; a commit that would do so checkpoints
+// first.
+//
+// In async mode (mkfs -a), end_op() does not commit: calls
+// return as soon as their changes are in the cache, and the
+// logckpt kernel thread commits the open transaction once it
+// is ASYNC_TICKS old. A transaction that runs out of space is
+// still committed by its last end_op(). log_sync() waits for a
+// given transaction to be durable, committing it if need be;
+// fsync() and fdatasync() use it.
+//
+// Committed blocks are not installed at their home locations
+// right away. The log holds many transactions, and the newest
+// committed snapshot of each block stays in memory (and its
+// cached block pinned) until a checkpoint writes them all home
+// at once, so a block that many transactions change is only
+// installed once. A checkpoint happens when the next commit
+// would not fit in the log, and every CKPT_TICKS in the
+// logckpt kernel thread.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   log superblock, with the sequence number of the first
+//     transaction since the last checkpoint
+//   header block, containing a sequence number, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
-//   block C
 //   ...
-// Log appends are synchronous.
+//   next header block, for the following sequence number
+//   ...
+// The checksum covers the rest of the header and the logged
+// blocks, so a transaction is committed exactly when all of
+// its log blocks and its header are on disk, in whatever order
+// they got there. After a checkpoint, the log starts again
+// right after the log superblock. Recovery replays, in order,
+// the transactions that follow the log superblock for as long
+// as their sequence numbers follow on and their checksums are
+// good. Replaying one that was checkpointed already is
+// harmless.
+//
+// Log appends are synchronous, but the blocks of one commit
+// and its header are written to the disk as one batch, and
+// so are the checkpoint writes; the disk queue merges each
+// into a few requests. Headers are written from a buffer of
+// their own, so a commit never has to read anything.
+//
+// The disk may cache writes, so "written" does not mean
+// durable: a commit flushes the disk cache after writing the
+// log, and a checkpoint flushes after installing, before it
+// moves the log superblock, and again before the log space is
+// used again.
+
+#define COMMIT_TICKS 3  // close a transaction open this long
+#define NDATA (3*MAXOPDATA) // max file data blocks in one transaction
+#define CKPT_TICKS  30  // checkpoint at least this often
+#define ASYNC_TICKS 10  // in async mode, commit a transaction this old
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint seq;     // transaction sequence number
+  uint cksum;   // logsum() of the transaction
   int n;
   int block[LOGSIZE];
 };
 
+// Contents of the log superblock.
+struct logsuper {
+  uint seq;     // of the transaction right after this block
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
+  int maxblocks;   // most blocks one transaction may log.
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they may still write,
+  int dreserved;   // and file data blocks.
+  int closing;     // open transaction takes no more calls.
+  int committing;  // a commit or checkpoint is running.
+  int async;       // end_op() leaves commits to logckpt.
+  uint tid;        // number of the open transaction.
+  uint durable;    // transactions up to this one are on disk.
+  uint opened;     // ticks when the open transaction began.
+  uint seq;        // sequence number of the next commit.
+  int pos;         // where the next commit's header goes.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction
+  struct {
+    int n;
+    int block[NDATA];
+  } ld;                 // file data blocks of the open transaction
+  uchar freed[FSSIZE/8+1]; // blocks it frees, by bit
+  int nfreed;
+
+  // the transaction being committed: its header, snapshots
+  // of its blocks, and the cached blocks, pinned until the
+  // snapshots are checkpointed.
+  struct logheader clh;
+  struct buf *snap[LOGSIZE];
+  struct buf *pinned[LOGSIZE];
+  int nd;               // and its file data blocks, likewise
+  struct buf *dsnap[NDATA];
+  struct buf *dpinned[NDATA];
+
+  // committed snapshots waiting for a checkpoint, newest
+  // first, through next. at most one per block.
+  struct buf *ckpt;
+  uint ckpted;     // ticks at the last checkpoint
+
+  struct kmem_cache *cache; // for snapshots
+  struct buf hbuf;      // for writing header blocks
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void logckpt(void);
+
+static void
+snapinit(void *p)
+{
+  initsleeplock(&((struct buf*)p)->lock, "log snapshot");
+}
 
 void
 initlog(int dev, struct superblock *sb)
@@ -58,107 +178,269 @@ initlog(int dev, struct superblock *sb)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
+  log.cache = kmem_cache_create("logsnap", sizeof(struct buf), snapinit, 0);
+  initsleeplock(&log.hbuf.lock, "log header");
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.async = (sb->flags & FS_ASYNC) != 0;
+  log.tid = 1;
+  // a transaction takes its header and blocks; the log
+  // superblock comes first.
+  log.maxblocks = log.size - 2;
+  if (log.maxblocks > LOGSIZE)
+    log.maxblocks = LOGSIZE;
+  if (log.maxblocks < MAXOPBLOCKS)
+    panic("initlog: log too small");
   recover_from_log();
+  log.ckpted = ticks;
+  kthread_create(logckpt, "logckpt");
+}
+
+// Checksum of a transaction: the header's seq, n and block
+// numbers, and the contents of the logged blocks, which
+// logsum_blocks() adds a few at a time.
+static uint
+logsum_head(struct logheader *h)
+{
+  uint sum = 2166136261U;   // FNV-1a, a word at a time
+  int i;
+
+  sum = (sum ^ h->seq) * 16777619U;
+  sum = (sum ^ h->n) * 16777619U;
+  for (i = 0; i < h->n; i++)
+    sum = (sum ^ h->block[i]) * 16777619U;
+  return sum;
+}
+
+static uint
+logsum_blocks(uint sum, struct buf **bv, int n)
+{
+  uint *w;
+  int i, j;
+
+  for (i = 0; i < n; i++) {
+    w = (uint *) bv[i]->data;
+    for (j = 0; j < BSIZE/sizeof(uint); j++)
+      sum = (sum ^ w[j]) * 16777619U;
+  }
+  return sum;
+}
+
+// logsum() of transaction h, whose n blocks are all in bv.
+static uint
+logsum(struct logheader *h, struct buf **bv)
+{
+  return logsum_blocks(logsum_head(h), bv, h->n);
 }
 
-// Copy committed blocks from log to their home location
+// Recovery reads a transaction's log blocks, and their home
+// locations, NRBUF at a time, so that it never needs more of
+// the buffer cache than NBUF however big the transaction.
+#define NRBUF (NBUF/2)
+
+// Read n log blocks, from the ith, of the transaction at pos.
 static void
-install_trans(int recovering)
+read_log(int pos, int i, int n, struct buf **lbuf)
 {
+  uint lblock[NRBUF];
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  for (tail = 0; tail < n; tail++)
+    lblock[tail] = log.start+pos+1+i+tail;
+  breadv(log.dev, lblock, n, lbuf);
+}
+
+// Is the transaction at pos, with header h, intact?
+static int
+check_trans(int pos, struct logheader *h)
+{
+  struct buf *lbuf[NRBUF];
+  uint sum = logsum_head(h);
+  int i, n, tail;
+
+  for (i = 0; i < h->n; i += n) {
+    n = h->n - i < NRBUF ? h->n - i : NRBUF;
+    read_log(pos, i, n, lbuf);
+    sum = logsum_blocks(sum, lbuf, n);
+    for (tail = 0; tail < n; tail++)
+      brelse(lbuf[tail]);
   }
+  return sum == h->cksum;
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy the committed blocks of the transaction at pos to
+// their home location. Only used for recovery, before any
+// other FS activity.
 static void
-read_head(void)
+install_trans(int pos, struct logheader *h)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *lbuf[NRBUF], *dbuf[NRBUF];
+  int i, n, tail;
+
+  for (i = 0; i < h->n; i += n) {
+    n = h->n - i < NRBUF ? h->n - i : NRBUF;
+    read_log(pos, i, n, lbuf);  // read log blocks
+    breadv(log.dev, (uint*)h->block + i, n, dbuf);  // read dsts
+    for (tail = 0; tail < n; tail++)
+      memmove(dbuf[tail]->data, lbuf[tail]->data, BSIZE);  // copy block to dst
+    bwritev(dbuf, n);  // write dsts to disk
+    for (tail = 0; tail < n; tail++) {
+      brelse(lbuf[tail]);
+      brelse(dbuf[tail]);
+    }
+  }
+}
+
+// Read the log header at pos into h. Returns 0 if
+// it cannot be the header of transaction seq.
+static int
+read_head(int pos, uint seq, struct logheader *h)
+{
+  struct buf *buf = bread(log.dev, log.start+pos);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  int ok;
+  h->seq = lh->seq;
+  h->cksum = lh->cksum;
+  h->n = lh->n;
+  ok = h->seq == seq && h->n >= 0 && h->n <= LOGSIZE && pos+1+h->n <= log.size;
+  for (i = 0; ok && i < h->n; i++) {
+    h->block[i] = lh->block[i];
   }
   brelse(buf);
+  return ok;
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Fill in the header buffer for transaction h, whose
+// blocks are in bv.
 static void
-write_head(void)
+fill_head(struct logheader *h, struct buf **bv)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (log.hbuf.data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  h->cksum = logsum(h, bv);
+  hb->seq = h->seq;
+  hb->cksum = h->cksum;
+  hb->n = h->n;
+  for (i = 0; i < h->n; i++) {
+    hb->block[i] = h->block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+}
+
+// Point the log superblock at transaction seq, which
+// will be written right after it.
+static void
+write_super(uint seq)
+{
+  acquiresleep(&log.hbuf.lock);
+  memset(log.hbuf.data, 0, BSIZE);
+  ((struct logsuper *) log.hbuf.data)->seq = seq;
+  log.hbuf.dev = log.dev;
+  log.hbuf.blockno = log.start;
+  bwrite(&log.hbuf);
+  releasesleep(&log.hbuf.lock);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  struct buf *sbuf;
+  int pos;
+  uint seq;
+
+  sbuf = bread(log.dev, log.start);
+  seq = ((struct logsuper *) sbuf->data)->seq;
+  brelse(sbuf);
+
+  // replay transactions seq, seq+1, ... while they are intact.
+  for (pos = 1; read_head(pos, seq, &log.lh); pos += 1+log.lh.n, seq++) {
+    if (!check_trans(pos, &log.lh))
+      break;
+    install_trans(pos, &log.lh); // copy from log to disk
+  }
   log.lh.n = 0;
-  write_head(); // clear the log
+
+  // start the log afresh.
+  bflush(log.dev);
+  write_super(seq);
+  bflush(log.dev);
+  log.seq = seq;
+  log.pos = 1;
 }
 
-// called at the start of each FS system call.
+// called at the start of each FS system call that may write
+// up to nblocks logged blocks and ndata blocks of file data.
 void
-begin_op(void)
+begin_op_n(int nblocks, int ndata)
 {
+  struct proc *p = myproc();
+
+  if(nblocks > log.maxblocks || ndata > NDATA)
+    panic("begin_op_n: too big");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + nblocks > log.maxblocks ||
+              log.ld.n + log.dreserved + ndata > NDATA ||
+              (!log.async && log.lh.n + log.ld.n > 0 &&
+               ticks - log.opened >= COMMIT_TICKS)){
+      // this op might exhaust log space, or the transaction
+      // has been open long enough; close it and wait for commit.
+      log.closing = 1;
+      if(log.outstanding == 0 && !log.committing){
+        // no end_op() is coming to commit it (async mode).
+        log.committing = 1;
+        release(&log.lock);
+        commit();
+        acquire(&log.lock);
+        continue;
+      }
       sleep(&log, &log.lock);
     } else {
+      if(log.outstanding == 0 && log.lh.n + log.ld.n == 0)
+        log.opened = ticks;
       log.outstanding += 1;
+      log.reserved += nblocks;
+      log.dreserved += ndata;
+      p->opblocks = nblocks;
+      p->opdata = ndata;
       release(&log.lock);
       break;
     }
   }
 }
 
+// begin_op_n() for a call that may write anything.
+void
+begin_op(void)
+{
+  begin_op_n(MAXOPBLOCKS, MAXOPDATA);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation
+// and no commit is running already, unless in async mode
+// the transaction can stay open.
 void
 end_op(void)
 {
+  struct proc *p = myproc();
   int do_commit = 0;
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  log.reserved -= p->opblocks;
+  log.dreserved -= p->opdata;
+  if(log.outstanding == 0 && !log.committing &&
+     (!log.async || log.closing)){
     do_commit = 1;
     log.committing = 1;
   } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // begin_op_n() may be waiting for log space,
+    // and this op has given back its reservation.
     wakeup(&log);
   }
   release(&log.lock);
@@ -167,44 +449,303 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Install every committed snapshot at its home location and
+// empty the log. Caller has set log.committing.
 static void
-write_log(void)
+checkpoint(void)
 {
-  int tail;
+  struct buf *v[LOGSIZE], *b, *next, *cb;
+  int n;
+
+  // install, LOGSIZE blocks at a time.
+  for (b = log.ckpt; b; ) {
+    for (n = 0; b && n < LOGSIZE; b = b->next) {
+      acquiresleep(&b->lock);
+      v[n++] = b;
+    }
+    bwritev(v, n);
+    while (n > 0)
+      releasesleep(&v[--n]->lock);
+  }
+  bflush(log.dev);    // ... before the log forgets them
+  write_super(log.seq);
+  bflush(log.dev);    // ... before the log space is reused
+  log.pos = 1;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  // the home locations are up to date: drop the
+  // snapshots and unpin the cached blocks.
+  for (b = log.ckpt; b; b = next) {
+    next = b->next;
+    cb = bread(log.dev, b->blockno);
+    bunpin(cb);
+    brelse(cb);
+    kmem_cache_free(log.cache, b);
+  }
+  log.ckpt = 0;
+  log.ckpted = ticks;
+}
+
+// Get a snapshot buffer, checkpointing to free
+// some up if memory is short.
+static struct buf*
+snapalloc(void)
+{
+  struct buf *b;
+
+  if ((b = kmem_cache_alloc(log.cache)) == 0 && log.ckpt) {
+    checkpoint();
+    b = kmem_cache_alloc(log.cache);
+  }
+  if (b == 0)
+    panic("log: no memory for snapshots");
+  return b;
+}
+
+// Close the open transaction, which has no outstanding
+// calls: snapshot its blocks and move it to log.clh.
+// Caller is the committer.
+static void
+snapshot(void)
+{
+  int i;
+
+  for (i = 0; i < log.lh.n; i++) {
+    struct buf *to = snapalloc();
+    struct buf *from = bread(log.dev, log.lh.block[i]); // cache block
+    to->dev = log.dev;
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    log.snap[i] = to;
+    log.pinned[i] = from;
     brelse(from);
-    brelse(to);
   }
+  log.clh = log.lh;
+  log.lh.n = 0;
+
+  for (i = 0; i < log.ld.n; i++) {
+    struct buf *to = snapalloc();
+    struct buf *from = bread(log.dev, log.ld.block[i]);
+    to->dev = log.dev;
+    to->blockno = from->blockno;
+    memmove(to->data, from->data, BSIZE);
+    log.dsnap[i] = to;
+    log.dpinned[i] = from;
+    brelse(from);
+  }
+  log.nd = log.ld.n;
+  log.ld.n = 0;
+
+  // the blocks it freed can be reused: the next transaction's
+  // file data is only written once this one has committed.
+  if (log.nfreed) {
+    memset(log.freed, 0, sizeof(log.freed));
+    log.nfreed = 0;
+  }
+}
+
+// Write the closed transaction's file data in place, and make
+// it durable before the transaction can commit.
+static void
+write_data(void)
+{
+  struct buf *b;
+  int i;
+
+  if (log.nd == 0)
+    return;
+
+  // a pending checkpoint must not overwrite this data later.
+  for (b = log.ckpt; b; b = b->next) {
+    for (i = 0; i < log.nd; i++)
+      if (log.dsnap[i]->blockno == b->blockno)
+        break;
+    if (i < log.nd) {
+      checkpoint();
+      break;
+    }
+  }
+
+  for (i = 0; i < log.nd; i++)
+    acquiresleep(&log.dsnap[i]->lock);
+  bwritev(log.dsnap, log.nd);
+  bflush(log.dev);  // ... before the metadata refers to it
+  for (i = 0; i < log.nd; i++) {
+    releasesleep(&log.dsnap[i]->lock);
+    kmem_cache_free(log.cache, log.dsnap[i]);
+    bunpin(log.dpinned[i]);
+  }
+  log.nd = 0;
 }
 
+// Write the file data in place, then the snapshots and header
+// to the log, and hand the snapshots over to the next checkpoint.
+static void
+write_trans(void)
+{
+  struct buf *v[LOGSIZE+1], *b, **pp;
+  int tail, n = log.clh.n;
+
+  write_data();
+  if (n == 0)
+    return;
+  if (log.pos + 1 + n > log.size)
+    checkpoint();   // the log is full
+
+  for (tail = 0; tail < n; tail++) {
+    v[tail] = log.snap[tail];
+    acquiresleep(&v[tail]->lock);
+    v[tail]->blockno = log.start+log.pos+1+tail;
+  }
+  log.clh.seq = log.seq;
+  acquiresleep(&log.hbuf.lock);
+  fill_head(&log.clh, v);
+  log.hbuf.dev = log.dev;
+  log.hbuf.blockno = log.start+log.pos;
+  v[n] = &log.hbuf;
+  bwritev(v, n+1); // Write snapshots and header to log
+  releasesleep(&log.hbuf.lock);
+  bflush(log.dev); // ... durably -- the real commit
+  log.seq++;
+  log.pos += 1+n;
+
+  for (tail = 0; tail < n; tail++) {
+    b = v[tail];
+    b->blockno = log.clh.block[tail];
+    releasesleep(&b->lock);
+    // replace any older snapshot of the same block, whose pin
+    // this one takes over.
+    for (pp = &log.ckpt; *pp; pp = &(*pp)->next) {
+      if ((*pp)->blockno == b->blockno) {
+        struct buf *old = *pp;
+        *pp = old->next;
+        kmem_cache_free(log.cache, old);
+        bunpin(log.pinned[tail]);
+        break;
+      }
+    }
+    b->next = log.ckpt;
+    log.ckpt = b;
+  }
+  log.clh.n = 0;
+}
+
+// Commit the open transaction, then any transaction that
+// completed while this one was being written. Caller has
+// set log.committing, which this clears.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  uint tid;
+
+  acquire(&log.lock);
+  while(log.outstanding == 0 && log.lh.n + log.ld.n > 0){
+    // keep new calls out while the blocks are copied.
+    log.closing = 1;
+    release(&log.lock);
+    snapshot();
+    acquire(&log.lock);
+    log.closing = 0;
+    tid = log.tid++;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_trans();
+
+    acquire(&log.lock);
+    log.durable = tid;
+    wakeup(&log);
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
+}
+
+// Is there work for logckpt? Caller holds tickslock; the
+// log fields are only a hint.
+static int
+logdue(void)
+{
+  if(ticks - log.ckpted >= CKPT_TICKS)
+    return 1;
+  if(log.lh.n + log.ld.n == 0)
+    return 0;
+  if(log.closing)   // closed, and nobody left to commit it?
+    return log.outstanding == 0;
+  return log.async && ticks - log.opened >= ASYNC_TICKS;
+}
+
+// Kernel thread that checkpoints the log every CKPT_TICKS,
+// so that home locations do not lag far behind the log, and
+// in async mode commits transactions once ASYNC_TICKS old.
+static void
+logckpt(void)
+{
+  for(;;){
+    acquire(&tickslock);
+    while(!logdue())
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    acquire(&log.lock);
+    while(log.committing)
+      sleep(&log, &log.lock);
+    log.committing = 1;
+    // have the last call commit if any are running.
+    if(log.async && log.outstanding > 0 && log.lh.n + log.ld.n > 0)
+      log.closing = 1;
+    release(&log.lock);
+
+    if(ticks - log.ckpted >= CKPT_TICKS){
+      if(log.ckpt)
+        checkpoint();
+      else
+        log.ckpted = ticks;
+    }
+
+    // commit the open transaction, or one that finished
+    // while we held log.committing, and let go.
+    commit();
+  }
+}
+
+// The open transaction, which the caller's changes are in
+// if it is inside begin_op_n()/end_op().
+uint
+log_tid(void)
+{
+  return log.tid;
+}
+
+// Wait until transaction tid, and all before it, are on disk,
+// committing it if it is still open.
+void
+log_sync(uint tid)
+{
+  acquire(&log.lock);
+  if(tid == log.tid && log.lh.n + log.ld.n == 0)
+    tid--;  // it has nothing in it
+  while((int)(log.durable - tid) < 0){
+    if(tid == log.tid){
+      if(log.outstanding == 0 && !log.committing){
+        log.committing = 1;
+        release(&log.lock);
+        commit();
+        acquire(&log.lock);
+        continue;
+      }
+      // the last call, or the running commit, commits it.
+      log.closing = 1;
+    }
+    sleep(&log, &log.lock);
+  }
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -216,12 +757,21 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.maxblocks)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
+  for (i = 0; i < log.ld.n; i++) {
+    if (log.ld.block[i] == b->blockno) {
+      // was file data earlier in this transaction, and
+      // is about to be logged instead.
+      log.ld.block[i] = log.ld.block[--log.ld.n];
+      bunpin(b);
+      break;
+    }
+  }
   for (i = 0; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
@@ -234,3 +784,59 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+// Like log_write(), for a block of file data: rather than
+// going into the log, it is written in place just before
+// the transaction commits.
+void
+log_write_data(struct buf *b)
+{
+  int i;
+
+  if (log.outstanding < 1)
+    panic("log_write_data outside of trans");
+
+  acquire(&log.lock);
+  for (i = 0; i < log.lh.n; i++) {
+    if (log.lh.block[i] == b->blockno) {
+      // logged already in this transaction; stays logged.
+      release(&log.lock);
+      return;
+    }
+  }
+  for (i = 0; i < log.ld.n; i++) {
+    if (log.ld.block[i] == b->blockno)
+      break;
+  }
+  if (i == log.ld.n) {
+    if (log.ld.n >= NDATA)
+      panic("too much data in a transaction");
+    log.ld.block[log.ld.n++] = b->blockno;
+    bpin(b);
+  }
+  release(&log.lock);
+}
+
+// Record that the open transaction frees block b, which
+// must not hold anything else until the transaction commits.
+void
+log_free(uint b)
+{
+  if (b >= FSSIZE)
+    panic("log_free");
+  acquire(&log.lock);
+  log.freed[b/8] |= 1 << (b%8);
+  log.nfreed++;
+  release(&log.lock);
+}
+
+// Did the open transaction free block b?
+int
+log_freed(uint b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = b < FSSIZE && (log.freed[b/8] & (1 << (b%8))) != 0;
+  release(&log.lock);
+  return r;
+}
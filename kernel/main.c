@@ -6,6 +6,13 @@
 
 volatile static int started = 0;
 
+// microseconds since the machine was reset.
+static uint64
+uptime_us(void)
+{
+  return r_time() / (MTIME_HZ / 1000000);
+}
+
 // start() jumps here in supervisor mode on all CPUs.
 void
 main()
@@ -19,10 +26,14 @@ main()
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    uint64 t0 = uptime_us();
     kinit();         // physical page allocator
+    printf("kinit: %d pages free in %d us\n", (int)kfreepages(), (int)(uptime_us() - t0));
+    slabinit();      // small object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    vmainit();       // mmap regions
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
@@ -30,13 +41,20 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    pipeinit();      // pipes
+#ifdef ROOT_RAMDISK
+    ramdiskinit();   // root file system in memory
+#else
     virtio_disk_init(); // emulated hard disk
+#endif
 #ifdef LAB_NET
     pci_init();
     sockinit();
 #endif
     userinit();      // first user process
+    kzeroinit();     // background page zeroing
     __sync_synchronize();
+    printf("hart %d ready at %d us\n", cpuid(), (int)uptime_us());
     started = 1;
   } else {
     while(started == 0)
@@ -46,6 +64,7 @@ main()
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+    printf("hart %d ready at %d us\n", cpuid(), (int)uptime_us());
   }
   scheduler();        
 }
@@ -15,6 +15,7 @@
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
+// RAMDISK -- the root file system image, if in memory
 // PHYSTOP -- end RAM used by the kernel
 
 // qemu puts UART registers here in physical memory.
@@ -29,6 +30,7 @@
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define MTIME_HZ 10000000L           // CLINT_MTIME cycles per second in qemu.
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -47,6 +49,15 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// with make ROOTDISK=ram, qemu loads fs.img at RAMDISK (see
+// the Makefile), and the page allocator stops short of it.
+#ifdef ROOT_RAMDISK
+#define RAMDISK 0x87000000L
+#define PAGETOP RAMDISK
+#else
+#define PAGETOP PHYSTOP
+#endif
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
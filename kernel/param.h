@@ -4,15 +4,19 @@
 #define NPROC        64  // maximum number of processes (speedsup bigfile)
 #endif
 #define NCPU          8  // maximum number of CPUs
+#define MAXORDER     10  // largest kalloc_pages() block is 2^MAXORDER pages
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // maximum number of unreferenced i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  20  // max # of blocks any FS op writes (OP_* in fs.h)
+#define MAXOPDATA    64  // max # of file data blocks any FS op writes
+#define LOGSIZE      64  // max data blocks in one transaction
+#define NLOG         (LOGSIZE*4)  // default blocks in the on-disk log (mkfs -l)
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
+#define RAMIN         4  // first readahead window, in blocks
+#define RAMAX        64  // largest readahead window, in blocks
 #ifdef LAB_FS
 #define FSSIZE       200000  // size of file system in blocks
 #else
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fs.h"
 
 struct cpu cpus[NCPU];
 
@@ -143,7 +144,7 @@ found:
   p->context.sp = p->kstack + PGSIZE;
   p->vma_bound=TRAPFRAME;
   for(int i=0;i<NVMA;i++){
-      p->vma->valid=0;
+      p->vma[i]=0;
   }
   return p;
 }
@@ -179,6 +180,7 @@ freeproc(struct proc *p)
   p->periodic=0;
   p->ustack=0;
   p->vma_bound=TRAPFRAME;
+  p->kthread=0;
 }
 
 // Create a user page table for a given process,
@@ -264,6 +266,35 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthread_start.
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kthread();
+  panic("kthread returned");
+}
+
+// Start a process that runs fn in the kernel and never
+// returns to user space. fn must not return.
+void
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+  p->kthread = fn;
+  p->context.ra = (uint64)kthread_start;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -381,7 +412,7 @@ exit(int status)
     }
   }
   unmap_all_vma(p);
-  begin_op();
+  begin_op_n(OP_IPUT, 0);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
@@ -502,7 +533,7 @@ scheduler(void)
     int nproc = 0;
     for(p = proc; p < &proc[NPROC]; p++) {
       acquire(&p->lock);
-      if(p->state != UNUSED) {
+      if(p->state != UNUSED && p->kthread == 0) {
         nproc++;
       }
       if(p->state == RUNNABLE) {
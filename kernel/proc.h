@@ -82,7 +82,6 @@ struct trapframe {
 #define NVMA 16
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 struct virtual_memory_area{
-    char   valid;
     uint64 vm_start;
     uint64 vm_end;
     uint32 vm_prot;
@@ -113,11 +112,14 @@ struct proc {
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
-  struct virtual_memory_area vma[NVMA];
+  struct virtual_memory_area *vma[NVMA]; // sorted by vm_start, descending
   uint64 vma_bound;
   struct inode *cwd;           // Current directory
+  int opblocks;                // log blocks reserved by begin_op_n()
+  int opdata;                  // and file data blocks
   char name[16];               // Process name (debugging)
   int init_tick;
   int left_tick;
   uint64 periodic;
+  void (*kthread)(void);       // Entry point, if a kernel thread
 };
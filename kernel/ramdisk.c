@@ -1,5 +1,10 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// ramdisk that holds the root file system image in memory.
+// qemu ... -device loader,file=fs.img,addr=RAMDISK,force-raw=on
+// puts it there before boot; see ROOTDISK in the Makefile.
+//
+// requests finish as soon as they are submitted, so this is
+// the block layer minus all disk and emulation costs.
 //
 
 #include "types.h"
@@ -12,34 +17,48 @@
 #include "fs.h"
 #include "buf.h"
 
-void
-ramdiskinit(void)
+#if RAMDISK + FSSIZE*BSIZE > PHYSTOP
+#error "file system image doesn't fit above RAMDISK"
+#endif
+
+// copy the n locked buffers in bv to or from the image.
+static void
+ramdisk_submit(struct buf **bv, int n, int write)
 {
+  for(int i = 0; i < n; i++){
+    struct buf *b = bv[i];
+
+    if(!holdingsleep(&b->lock))
+      panic("ramdisk: buf not locked");
+    if(b->blockno >= FSSIZE)
+      panic("ramdisk: blockno too big");
+
+    char *addr = (char *)RAMDISK + (uint64)b->blockno * BSIZE;
+    if(write)
+      memmove(addr, b->data, BSIZE);
+    else
+      memmove(b->data, addr, BSIZE);
+    b->disk = 0;
+    if(b->done)
+      b->done(b);
+  }
+}
+
+static void
+ramdisk_wait(struct buf *b)
+{
+  if(b->disk)
+    panic("ramdisk_wait");
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
 void
-ramdiskrw(struct buf *b)
+ramdiskinit(void)
 {
-  if(!holdingsleep(&b->lock))
-    panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
-    panic("ramdiskrw: blockno too big");
-
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
-
-  if(b->flags & B_DIRTY){
-    // write
-    memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
-    memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
-  }
+  struct superblock *sb = (struct superblock *)(RAMDISK + BSIZE);
+
+  // mkfs puts the superblock in block 1.
+  if(sb->magic != FSMAGIC)
+    panic("ramdisk: no file system image");
+  bdevsw[ROOTDEV].submit = ramdisk_submit;
+  bdevsw[ROOTDEV].wait = ramdisk_wait;
 }
@@ -0,0 +1,283 @@
+// Slab allocator for small kernel objects (files, pipes,
+// inodes, ...), built on kalloc().
+//
+// Each cache hands out objects of one size. Objects are carved
+// out of slabs, one kalloc()ed page each, whose header keeps a
+// stack of the indices of its free objects. A constructor, if
+// given, runs once when a slab is created, and a destructor
+// when its page is given back; in between, objects go back to
+// the cache in their constructed state, so callers must reset
+// whatever fields they rely on.
+//
+// Each CPU keeps a small magazine of free objects per cache,
+// guarded only by push_off(), so that most allocations and
+// frees do not touch the cache lock at all.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NSLABCACHE 16          // maximum number of caches
+#define SLAB_MAG   8           // objects in a per-CPU magazine
+#define SLAB_BATCH (SLAB_MAG/2) // objects moved per refill or flush
+
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  char *base;          // first object
+  uint nfree;          // entries on free[]
+  ushort free[];       // indices of free objects
+};
+
+struct kmem_cpu {
+  int n;
+  void *obj[SLAB_MAG];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;           // object size, rounded up to 8 bytes
+  uint nper;           // objects per slab
+  uint off;            // offset of the first object in a slab
+  void (*ctor)(void*);
+  void (*dtor)(void*);
+  struct spinlock lock;
+  struct slab partial; // slabs with at least one free object
+  struct slab full;    // slabs with none
+  int nempty;          // completely free slabs on partial
+  struct kmem_cpu cpu[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NSLABCACHE];
+  int n;
+} slabs;
+
+static void
+slab_push(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+static void
+slab_remove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache of objects of the given size.
+// ctor and dtor may be 0.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void*), void (*dtor)(void*))
+{
+  struct kmem_cache *cp;
+  uint nper, off;
+
+  size = (size + 7) & ~7;
+  nper = (PGSIZE - sizeof(struct slab)) / (size + sizeof(ushort));
+  for(; nper > 0; nper--){
+    off = (sizeof(struct slab) + nper*sizeof(ushort) + 7) & ~7;
+    if(off + nper*size <= PGSIZE)
+      break;
+  }
+  if(nper == 0)
+    panic("kmem_cache_create: object too big");
+
+  acquire(&slabs.lock);
+  if(slabs.n == NSLABCACHE)
+    panic("kmem_cache_create: too many caches");
+  cp = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  cp->name = name;
+  cp->size = size;
+  cp->nper = nper;
+  cp->off = off;
+  cp->ctor = ctor;
+  cp->dtor = dtor;
+  initlock(&cp->lock, name);
+  cp->partial.next = cp->partial.prev = &cp->partial;
+  cp->full.next = cp->full.prev = &cp->full;
+  cp->nempty = 0;
+  for(int i = 0; i < NCPU; i++)
+    cp->cpu[i].n = 0;
+  return cp;
+}
+
+// Get a fresh page and construct a slab's worth of objects in it.
+static struct slab*
+slab_create(struct kmem_cache *cp)
+{
+  struct slab *s;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->base = (char*)s + cp->off;
+  s->nfree = cp->nper;
+  for(uint i = 0; i < cp->nper; i++){
+    s->free[i] = cp->nper - 1 - i;
+    if(cp->ctor)
+      cp->ctor(s->base + i*cp->size);
+  }
+  return s;
+}
+
+static void
+slab_destroy(struct kmem_cache *cp, struct slab *s)
+{
+  if(cp->dtor)
+    for(uint i = 0; i < cp->nper; i++)
+      cp->dtor(s->base + i*cp->size);
+  kfree((void*)s);
+}
+
+// Move up to SLAB_BATCH objects from the slabs into m.
+// Caller has interrupts off.
+static void
+slab_refill(struct kmem_cache *cp, struct kmem_cpu *m)
+{
+  struct slab *s;
+
+  acquire(&cp->lock);
+  if(cp->partial.next == &cp->partial){
+    // build the new slab without the lock, since
+    // kalloc() may have to reclaim memory from caches.
+    release(&cp->lock);
+    if((s = slab_create(cp)) == 0)
+      return;
+    acquire(&cp->lock);
+    slab_push(&cp->partial, s);
+    cp->nempty++;
+  }
+  while(m->n < SLAB_BATCH && cp->partial.next != &cp->partial){
+    s = cp->partial.next;
+    if(s->nfree == cp->nper)
+      cp->nempty--;
+    while(m->n < SLAB_BATCH && s->nfree > 0)
+      m->obj[m->n++] = s->base + s->free[--s->nfree]*cp->size;
+    if(s->nfree == 0){
+      slab_remove(s);
+      slab_push(&cp->full, s);
+    }
+  }
+  release(&cp->lock);
+}
+
+// Give n objects from m back to their slabs, keeping at most
+// one completely free slab around.
+// Caller has interrupts off.
+static void
+slab_flush(struct kmem_cache *cp, struct kmem_cpu *m, int n)
+{
+  struct slab *s, *dead;
+  char *obj;
+
+  dead = 0;
+  acquire(&cp->lock);
+  while(n-- > 0 && m->n > 0){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    if(s->nfree == 0){
+      slab_remove(s);
+      slab_push(&cp->partial, s);
+    }
+    s->free[s->nfree++] = (obj - s->base) / cp->size;
+    if(s->nfree == cp->nper){
+      if(cp->nempty > 0){
+        slab_remove(s);
+        s->next = dead;
+        dead = s;
+      } else
+        cp->nempty++;
+    }
+  }
+  release(&cp->lock);
+
+  for(; dead; dead = s){
+    s = dead->next;
+    slab_destroy(cp, dead);
+  }
+}
+
+// Give this CPU's magazine back to cp's slabs and free every
+// completely free slab. Other CPUs' magazines, which only
+// their owners may touch, are left alone. Returns the number
+// of pages freed.
+int
+kmem_cache_shrink(struct kmem_cache *cp)
+{
+  struct slab *s, *next, *dead;
+  int n;
+
+  push_off();
+  slab_flush(cp, &cp->cpu[cpuid()], SLAB_MAG);
+  pop_off();
+
+  dead = 0;
+  acquire(&cp->lock);
+  for(s = cp->partial.next; s != &cp->partial; s = next){
+    next = s->next;
+    if(s->nfree == cp->nper){
+      slab_remove(s);
+      s->next = dead;
+      dead = s;
+    }
+  }
+  cp->nempty = 0;
+  release(&cp->lock);
+
+  for(n = 0; dead; dead = s, n++){
+    s = dead->next;
+    slab_destroy(cp, dead);
+  }
+  return n;
+}
+
+// Allocate an object from cache cp.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+  struct kmem_cpu *m;
+  void *obj;
+
+  obj = 0;
+  push_off();
+  m = &cp->cpu[cpuid()];
+  if(m->n == 0)
+    slab_refill(cp, m);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Return an object obtained from kmem_cache_alloc(cp).
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+  struct kmem_cpu *m;
+
+  if(obj == 0 || (uint64)obj % 8 != 0)
+    panic("kmem_cache_free");
+  push_off();
+  m = &cp->cpu[cpuid()];
+  if(m->n == SLAB_MAG)
+    slab_flush(cp, m, SLAB_BATCH);
+  m->obj[m->n++] = obj;
+  pop_off();
+}
@@ -111,6 +111,8 @@ extern uint64 sys_sigra(void);
 extern uint64 sys_symlink(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]      sys_fork,
@@ -141,6 +143,8 @@ static uint64 (*syscalls[])(void) = {
 [SYS_symlink]   sys_symlink,
 [SYS_mmap]      sys_mmap,
 [SYS_munmap]    sys_munmap,
+[SYS_fsync]     sys_fsync,
+[SYS_fdatasync] sys_fdatasync,
 };
 
 void
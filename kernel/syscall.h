@@ -26,4 +26,6 @@
 #define SYS_sigra       25
 #define SYS_symlink     26
 #define SYS_mmap        27
-#define SYS_munmap      28
\ No newline at end of file
+#define SYS_munmap      28
+#define SYS_fsync       29
+#define SYS_fdatasync   30
\ No newline at end of file
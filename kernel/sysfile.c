@@ -115,6 +115,26 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 0);
+}
+
+uint64
+sys_fdatasync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f, 1);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -125,7 +145,7 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op_n(1 + OP_DIRENT, 0);  // the i-node and the new entry
   if((ip = namei(old)) == 0){
     end_op();
     return -1;
@@ -192,7 +212,7 @@ sys_unlink(void)
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_op_n(2 + OP_IPUT, 0);  // the entry, the parent, the i-node
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -298,7 +318,12 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  // creating a file, or truncating one or dropping an
+  // unlinked i-node.
+  n = OP_IPUT;
+  if((omode & O_CREATE) && n < OP_CREATE)
+    n = OP_CREATE;
+  begin_op_n(n, 0);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -367,7 +392,7 @@ uint64 sys_symlink(void){
     if(argstr(0, target, MAXPATH) < 0 || argstr(1, path, MAXPATH) < 0){
         return -1;
     }
-    begin_op();
+    begin_op_n(OP_CREATE + 2, 0);  // and the target's block and bitmap
     struct inode *ip=create(path, T_SYMLINK, 0, 0);
     if(ip==0){
         end_op();
@@ -431,7 +456,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op_n(OP_CREATE, 0);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -448,7 +473,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op_n(OP_CREATE, 0);
   if((argstr(0, path, MAXPATH)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -468,7 +493,7 @@ sys_chdir(void)
   struct inode *ip;
   struct proc *p = myproc();
   
-  begin_op();
+  begin_op_n(OP_IPUT, 0);
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
     end_op();
     return -1;
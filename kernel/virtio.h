@@ -27,6 +27,7 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_CONFIG		0x100 // device-specific configuration
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -35,8 +36,10 @@
 #define VIRTIO_CONFIG_S_FEATURES_OK	8
 
 // device feature bits
+#define VIRTIO_BLK_F_SEG_MAX         2	/* Maximum number of segments in a request */
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
 #define VIRTIO_F_ANY_LAYOUT         27
@@ -44,8 +47,17 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two; see VIRTIO_NUM in the Makefile.
+#ifndef VIRTIO_NUM
+#define VIRTIO_NUM 64
+#endif
+#if VIRTIO_NUM <= 0 || (VIRTIO_NUM & (VIRTIO_NUM-1)) != 0
+#error "VIRTIO_NUM must be a power of two"
+#endif
+#define NUM VIRTIO_NUM
+
+// most data segments (blocks) in one indirect request.
+#define NSEG 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,14 +68,16 @@ struct virtq_desc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT or zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
-  uint16 unused;
+  uint16 used_event; // with EVENT_IDX: interrupt once used idx passes this
 };
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // hint: driver doesn't want interrupts
 
 // one entry in the "used" ring, with which the
 // device tells the driver about completed requests.
@@ -73,20 +87,39 @@ struct virtq_used_elem {
 };
 
 struct virtq_used {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_USED_F_NO_NOTIFY or zero
   uint16 idx;   // device increments when it adds a ring[] entry
   struct virtq_used_elem ring[NUM];
+  uint16 avail_event; // with EVENT_IDX: notify once avail idx passes this
 };
+#define VRING_USED_F_NO_NOTIFY 1 // hint: device doesn't need notifying
+
+// with EVENT_IDX, should the other side be told that the index
+// moved from old to new, given that it asked to hear about event?
+#define vring_need_event(event, new, old) \
+  ((uint16)((new) - (event) - 1) < (uint16)((new) - (old)))
+
+// the legacy layout of a queue in memory: the descriptors,
+// then the avail ring, then the used ring on the next page.
+#define VRING_AVAIL_OFF (NUM*sizeof(struct virtq_desc))
+#define VRING_USED_OFF  PGROUNDUP(VRING_AVAIL_OFF + sizeof(struct virtq_avail))
+#define VRING_SIZE      (VRING_USED_OFF + PGROUNDUP(sizeof(struct virtq_used)))
 
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // make completed writes durable
+
+// offsets in the device configuration.
+#define VIRTIO_BLK_CONFIG_SEG_MAX    12 // uint32 seg_max
+#define VIRTIO_BLK_CONFIG_WRITEBACK  32 // uint8 writeback, with CONFIG_WCE
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 32 // word holding uint16 num_queues at 34
 
 // the format of the first descriptor in a disk request.
-// to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// to be followed by descriptors containing the blocks,
+// and a one-byte status.
 struct virtio_blk_req {
   uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
   uint32 reserved;
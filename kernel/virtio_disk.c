@@ -20,12 +20,15 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one virtqueue. with VIRTIO_BLK_F_MQ the device has several,
+// and each CPU submits to its own, so that CPUs doing disk I/O
+// at the same time don't contend for one lock.
+struct virtq {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM. pages[] allocates that memory. it must consist
+  // of contiguous pages of page-aligned physical memory, so the
+  // whole struct virtq comes from kalloc_pages().
+  char pages[VRING_SIZE];
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -53,15 +56,35 @@ static struct disk {
   // points into pages[].
   struct virtq_used *used;
 
+  // with VIRTIO_RING_F_INDIRECT_DESC, each request takes a single
+  // descriptor in the ring, pointing at its own table of
+  // descriptors here: the header, the blocks, and the status.
+  // indexed by the ring descriptor.
+  struct virtq_desc indirect[NUM][NSEG+2];
+
   // our own book-keeping.
+  int id;          // queue number
   char free[NUM];  // is a descriptor free?
+  int nfree;       // how many are
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 kicked;   // avail idx at the last notify
+  int polling;     // is a waiter polling the used ring?
+  int flushwant;   // flushes waiting for descriptors
+  uint64 lat;      // moving average of request latency, in cycles
+
+  // the elevator's queue of requests not yet handed to the
+  // device, sorted by block number, through buf.qnext.
+  struct buf *pending;
+  uint headpos;    // block after the last one dispatched
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;   // first buffer; the rest follow on qnext
+    int n;           // number of buffers
+    int *flushed;    // for a flush, set when it finishes
+    uint64 start;    // r_time() when posted
     char status;
   } info[NUM];
 
@@ -69,17 +92,63 @@ static struct disk {
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
 
-  struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
+  struct spinlock lock;
+};
+
+static struct disk {
+  int use_indirect; // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+  int event_idx;   // negotiated VIRTIO_RING_F_EVENT_IDX?
+  int flush;       // negotiated VIRTIO_BLK_F_FLUSH?
+  int maxseg;      // most blocks in one request
+  int nq;          // number of virtqueues
+  struct virtq *q[NCPU];
+} disk;
+
+// set up virtqueue i.
+static void
+virtq_init(int i)
+{
+  struct virtq *vq;
+  int order;
+
+  for(order = 0; (PGSIZE << order) < sizeof(struct virtq); order++)
+    ;
+  if((vq = kalloc_pages(order)) == 0)
+    panic("virtq_init: kalloc");
+  memset(vq, 0, sizeof(*vq));
+  initlock(&vq->lock, "virtio_disk");
+  vq->id = i;
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = i;
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)vq->pages) >> PGSHIFT;
+
+  // desc = pages -- num * virtq_desc
+  // avail = pages + num*16 -- 2 * uint16, then num * uint16
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem
+
+  vq->desc = (struct virtq_desc *) vq->pages;
+  vq->avail = (struct virtq_avail *)(vq->pages + VRING_AVAIL_OFF);
+  vq->used = (struct virtq_used *) (vq->pages + VRING_USED_OFF);
+
+  // all NUM descriptors start out unused.
+  for(int j = 0; j < NUM; j++)
+    vq->free[j] = 1;
+  vq->nfree = NUM;
+
+  disk.q[i] = vq;
+}
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
      *R(VIRTIO_MMIO_VERSION) != 1 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
@@ -97,12 +166,42 @@ virtio_disk_init(void)
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.event_idx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
+
+  // with FLUSH, the device may keep written blocks in a volatile
+  // cache until told to flush it, which the log does at the
+  // points where it needs writes to be durable. CONFIG_WCE lets
+  // us turn that write-back caching on explicitly.
+  disk.flush = (features & (1 << VIRTIO_BLK_F_FLUSH)) != 0;
+  if(disk.flush && (features & (1 << VIRTIO_BLK_F_CONFIG_WCE)))
+    *(volatile uint8 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_WRITEBACK) = 1;
+
+  // a request needs a descriptor for the header and one for the
+  // status besides its blocks. without indirect descriptors
+  // they all come out of the ring. either way, no more than
+  // NSEG, which virtio_disk_post() sizes its chain for.
+  disk.use_indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  disk.maxseg = NSEG;
+  if(!disk.use_indirect && NUM-2 < NSEG)
+    disk.maxseg = NUM-2;
+  if(features & (1 << VIRTIO_BLK_F_SEG_MAX)){
+    uint32 segmax = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_SEG_MAX);
+    if(segmax > 0 && segmax < disk.maxseg)
+      disk.maxseg = segmax;
+  }
+
+  // use up to one queue per CPU.
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    // num_queues is the upper half of the 32-bit word.
+    disk.nq = *R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES) >> 16;
+    if(disk.nq < 1)
+      disk.nq = 1;
+    if(disk.nq > NCPU)
+      disk.nq = NCPU;
+  }
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -114,39 +213,27 @@ virtio_disk_init(void)
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
+  for(int i = 0; i < disk.nq; i++)
+    virtq_init(i);
 
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  bdevsw[ROOTDEV].submit = virtio_disk_submit;
+  bdevsw[ROOTDEV].wait = virtio_disk_wait;
+  bdevsw[ROOTDEV].flush = virtio_disk_flush;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // a virtio-mmio device has just the one interrupt for all
+  // of its queues, which the PLIC gives to whichever hart
+  // claims it first.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct virtq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
+      vq->nfree--;
       return i;
     }
   }
@@ -155,28 +242,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct virtq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
+  vq->nfree++;
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct virtq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -184,106 +271,353 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// build one request of the given type for the n buffers of
+// consecutive blocks starting at b (linked through qnext), and
+// put it on the avail ring. a flush has no buffers. a request
+// is a chain of n+2 descriptors: the header, one per buffer,
+// and the status byte. returns the head descriptor. the chain is
+// either in the ring itself or, with indirect descriptors,
+// in a table that a single ring descriptor points to.
+// caller holds vq->lock and has checked vq->nfree.
 static int
-alloc3_desc(int *idx)
-{
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
-  return 0;
-}
-
-void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_post(struct virtq *vq, int type, struct buf *b, int n)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  int write = type == VIRTIO_BLK_T_OUT;
+  int head, id[NSEG+2];
+  struct virtq_desc *d;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result.
+  // qemu's virtio-blk.c reads them.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+  head = alloc_desc(vq);
+  if(disk.use_indirect){
+    d = vq->indirect[head];
+    for(int i = 0; i < n+2; i++)
+      id[i] = i;
+    vq->desc[head].addr = (uint64) d;
+    vq->desc[head].len = (n+2) * sizeof(struct virtq_desc);
+    vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+    vq->desc[head].next = 0;
+  } else {
+    d = vq->desc;
+    id[0] = head;
+    for(int i = 1; i < n+2; i++)
+      id[i] = alloc_desc(vq);
   }
 
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
-
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[head];
 
-  if(write)
-    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->type = type;
   buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  buf0->sector = b ? (uint64)b->blockno * (BSIZE / 512) : 0;
+
+  d[id[0]].addr = (uint64) buf0;
+  d[id[0]].len = sizeof(struct virtio_blk_req);
+  d[id[0]].flags = VRING_DESC_F_NEXT;
+  d[id[0]].next = id[1];
+
+  // record the buffers for virtio_disk_intr().
+  vq->info[head].b = b;
+  vq->info[head].n = n;
+  vq->info[head].start = r_time();
+
+  for(int i = 1; i <= n; i++, b = b->qnext){
+    d[id[i]].addr = (uint64) b->data;
+    d[id[i]].len = BSIZE;
+    if(write)
+      d[id[i]].flags = 0; // device reads b->data
+    else
+      d[id[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    d[id[i]].flags |= VRING_DESC_F_NEXT;
+    d[id[i]].next = id[i+1];
+  }
+
+  vq->info[head].status = 0xff; // device writes 0 on success
+  d[id[n+1]].addr = (uint64) &vq->info[head].status;
+  d[id[n+1]].len = 1;
+  d[id[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[id[n+1]].next = 0;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  vq->avail->ring[vq->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  vq->avail->idx += 1; // not % NUM ...
+  return head;
+}
+
+// tell the device about requests posted since the last kick,
+// unless it has said it doesn't need to hear about them: it
+// is still working through the avail ring and will find them.
+// caller holds vq->lock.
+static void
+virtio_disk_kick(struct virtq *vq)
+{
+  uint16 old = vq->kicked;
+  uint16 new = vq->avail->idx;
 
+  if(new == old)
+    return;
+  vq->kicked = new;
   __sync_synchronize();
+  if(disk.event_idx){
+    if(!vring_need_event(vq->used->avail_event, new, old))
+      return;
+  } else if(vq->used->flags & VRING_USED_F_NO_NOTIFY)
+    return;
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = vq->id; // value is queue number
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// ask the device for an interrupt at the next completion,
+// or (on == 0) for none at all while someone polls.
+// caller holds vq->lock.
+static void
+virtio_disk_intr_on(struct virtq *vq, int on)
+{
+  if(disk.event_idx){
+    // the device interrupts when used->idx moves past
+    // used_event, which used_idx-1 puts 64K requests away.
+    vq->avail->used_event = on ? vq->used_idx : vq->used_idx - 1;
+  } else {
+    vq->avail->flags = on ? 0 : VRING_AVAIL_F_NO_INTERRUPT;
+  }
+  __sync_synchronize();
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// The elevator. Submitted buffers wait on vq->pending, sorted
+// by block number, until there are descriptors to send them to
+// the device. Requests are dispatched in one-way sweeps (C-SCAN)
+// starting from the block after the last one sent, and a run of
+// consecutive blocks in the same direction goes out as a single
+// request. So that a stream of nearby requests cannot hold back
+// a distant one forever, a request older than DEADLINE is sent
+// next regardless of the sweep.
+#define DEADLINE (MTIME_HZ/20)   // 50ms, in CLINT cycles
+
+// caller holds vq->lock.
+static void
+virtio_disk_dispatch(struct virtq *vq)
+{
+  struct buf *b, *prev, *first, *fprev, *last;
+  uint64 now = r_time();
+  int n, need;
+
+  need = disk.use_indirect ? 1 : 3;
+  while(vq->pending && vq->nfree >= need && !vq->flushwant){
+    // choose where to start: the most overdue request, if
+    // any, else the next block along the sweep, else wrap.
+    first = fprev = 0;
+    for(prev = 0, b = vq->pending; b; prev = b, b = b->qnext){
+      if(b->deadline <= now && (first == 0 || b->deadline < first->deadline)){
+        first = b;
+        fprev = prev;
+      }
+    }
+    if(first == 0){
+      for(prev = 0, b = vq->pending; b && b->blockno < vq->headpos; prev = b, b = b->qnext)
+        ;
+      if(b == 0){
+        b = vq->pending;
+        prev = 0;
+      }
+      first = b;
+      fprev = prev;
+    }
+
+    // extend it by the buffers for the following blocks.
+    last = first;
+    for(n = 1; n < disk.maxseg && (disk.use_indirect || n < vq->nfree - 2); n++){
+      b = last->qnext;
+      if(b == 0 || b->blockno != last->blockno + 1 || b->write != first->write)
+        break;
+      last = b;
+    }
+
+    if(fprev)
+      fprev->qnext = last->qnext;
+    else
+      vq->pending = last->qnext;
+    last->qnext = 0;
+    vq->headpos = last->blockno + 1;
+    virtio_disk_post(vq, first->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, first, n);
+  }
+  virtio_disk_kick(vq);
+}
+
+// Take finished requests off the used ring, report their
+// buffers, and give the freed descriptors to the elevator.
+// caller holds vq->lock.
+static void
+virtio_disk_complete(struct virtq *vq)
+{
+  uint64 now;
+
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+  while(1){
+    while(vq->used_idx != vq->used->idx){
+      __sync_synchronize();
+      int id = vq->used->ring[vq->used_idx % NUM].id;
+
+      if(vq->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      struct buf *b = vq->info[id].b;
+      int n = vq->info[id].n;
+      int *flushed = vq->info[id].flushed;
+      vq->info[id].b = 0;
+      vq->info[id].flushed = 0;
+      free_chain(vq, id);
+
+      now = r_time();
+      vq->lat = vq->lat - vq->lat/8 + (now - vq->info[id].start)/8;
+
+      for(int i = 0; i < n; i++){
+        struct buf *next = b->qnext;
+        b->disk = 0;   // disk is done with buf
+        if(b->done)
+          b->done(b);
+        else
+          wakeup(b);
+        b = next;
+      }
+      if(flushed){
+        *flushed = 1;
+        wakeup(flushed);
+      }
+
+      vq->used_idx += 1;
+    }
+    if(vq->polling)
+      break;
+    // re-arm the interrupt, then look again in case a request
+    // finished after the loop above but before the device
+    // could see the new used_event.
+    virtio_disk_intr_on(vq, 1);
+    if(vq->used_idx == vq->used->idx)
+      break;
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  // the freed descriptors can take more requests,
+  // waiting flushes first.
+  if(vq->flushwant)
+    wakeup(&vq->flushwant);
+  virtio_disk_dispatch(vq);
+}
 
-  release(&disk.vdisk_lock);
+// Asynchronous interface. A request is a locked buffer;
+// b->done says how its completion is reported:
+// * if set, virtio_disk_intr() calls b->done(b) once the
+//   transfer has finished. it runs in interrupt context
+//   and must not sleep.
+// * if 0, the submitter calls virtio_disk_wait(b).
+// Submitting never sleeps: requests queue up in the elevator
+// until the device has room for them.
+
+// Submit n requests, all reads or all writes. Submitting
+// them together lets the elevator merge neighbouring blocks.
+void
+virtio_disk_submit(struct buf **bv, int n, int write)
+{
+  struct virtq *vq;
+  struct buf **pp;
+  uint64 deadline = r_time() + DEADLINE;
+
+  // this CPU's queue. it's fine if we move to
+  // another CPU before taking the lock.
+  push_off();
+  vq = disk.q[cpuid() % disk.nq];
+  pop_off();
+
+  acquire(&vq->lock);
+  for(int i = 0; i < n; i++){
+    struct buf *b = bv[i];
+    b->disk = 1;
+    b->vq = vq->id;
+    b->write = write;
+    b->deadline = deadline;
+    for(pp = &vq->pending; *pp && (*pp)->blockno < b->blockno; pp = &(*pp)->qnext)
+      ;
+    b->qnext = *pp;
+    *pp = b;
+  }
+  virtio_disk_dispatch(vq);
+  release(&vq->lock);
 }
 
+// Hybrid polling. When the disk has lately been answering
+// faster than a sleep and wakeup would take, a waiter spins on
+// the used ring for about twice the usual latency, with the
+// device's interrupts turned off, before going to sleep. One
+// waiter polls at a time, and handles every completion it sees.
+#define POLL_MAX (MTIME_HZ/10000)   // 100us, in CLINT cycles
+
+// Wait for a request submitted with b->done == 0.
 void
-virtio_disk_intr()
+virtio_disk_wait(struct buf *b)
+{
+  struct virtq *vq = disk.q[b->vq];
+  uint64 start, limit;
+
+  acquire(&vq->lock);
+  if(b->disk == 1 && !vq->polling && vq->lat < POLL_MAX){
+    vq->polling = 1;
+    virtio_disk_intr_on(vq, 0);
+    start = r_time();
+    limit = 2*vq->lat;
+    while(b->disk == 1 && r_time() - start < limit){
+      virtio_disk_complete(vq);
+      // let the interrupt handler and submitters in.
+      release(&vq->lock);
+      acquire(&vq->lock);
+    }
+    vq->polling = 0;
+    virtio_disk_complete(vq);
+  }
+  while(b->disk == 1) {
+    sleep(b, &vq->lock);
+  }
+  release(&vq->lock);
+}
+
+// Make the writes that have finished so far durable, by
+// flushing the device's write cache. Writes still in flight
+// are not covered; wait for them first.
+void
+virtio_disk_flush(void)
 {
-  acquire(&disk.vdisk_lock);
+  struct virtq *vq;
+  int flushed = 0, head;
+
+  if(!disk.flush)
+    return;   // the device writes through
+
+  push_off();
+  vq = disk.q[cpuid() % disk.nq];
+  pop_off();
+
+  acquire(&vq->lock);
+  // hold the elevator back until there is room for the flush.
+  vq->flushwant++;
+  while(vq->nfree < (disk.use_indirect ? 1 : 2))
+    sleep(&vq->flushwant, &vq->lock);
+  vq->flushwant--;
+  head = virtio_disk_post(vq, VIRTIO_BLK_T_FLUSH, 0, 0);
+  vq->info[head].flushed = &flushed;
+  virtio_disk_dispatch(vq);
+  while(!flushed)
+    sleep(&flushed, &vq->lock);
+  release(&vq->lock);
+}
 
+void
+virtio_disk_intr()
+{
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -294,22 +628,11 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
+  // the interrupt doesn't say which queue, so look at them all.
+  for(int i = 0; i < disk.nq; i++){
+    struct virtq *vq = disk.q[i];
+    acquire(&vq->lock);
+    virtio_disk_complete(vq);
+    release(&vq->lock);
   }
-
-  release(&disk.vdisk_lock);
 }
@@ -74,11 +74,9 @@ void
 proc_kvminit(struct proc* proc)
 {
     if(proc==nullptr){
-        kernel_pagetable = (pagetable_t) kalloc();
-        memset(kernel_pagetable, 0, PGSIZE);
+        kernel_pagetable = (pagetable_t) kalloc_zeroed();
     } else{
-        proc->kernel_pagetable=(pagetable_t) kalloc();
-        memset(proc->kernel_pagetable, 0, PGSIZE);
+        proc->kernel_pagetable=(pagetable_t) kalloc_zeroed();
     }
 
     // uart registers
@@ -207,9 +205,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -341,10 +338,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -358,8 +354,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -378,14 +373,18 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    pte= walk(pagetable,a,0);
+    // a COW page is about to be overwritten with its old
+    // contents; anything else must start out zeroed.
+    if(pte!=0&& IS_COW(*pte))
+      mem = kalloc();
+    else
+      mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    pte= walk(pagetable,a,0);
     if(pte!=0&& IS_COW(*pte)){
-//        mem=kalloc();
         flags=COW_WFLAGS(*pte);
         memmove(mem,(char *)PTE2PA(*pte),PGSIZE);
         uvmunmap(pagetable,a,1,1);
@@ -395,7 +394,6 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
             return 0;
         }
     }else{
-        memset(mem, 0, PGSIZE);
         if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
             kfree(mem);
             uvmdealloc(pagetable, a, oldsz);
@@ -508,9 +506,7 @@ copy(pagetable_t old, pagetable_t new, uint64 begin,uint64 copy_end)
 //      kfree(mem);
       goto err;
     }
-    kreflock((void *)pa);
-    inc_refcount(pa);
-    krefunlock((void *)pa);
+    krefinc((void *)pa);
   }
   return 0;
 
@@ -764,6 +760,14 @@ void pte_parser(pte_t pte){
            b(flags&PTE_C));
 #undef b
 }
+struct kmem_cache *vmacache;
+
+void
+vmainit(void)
+{
+  vmacache = kmem_cache_create("vma", sizeof(struct virtual_memory_area), 0, 0);
+}
+
 int in_Interval(uint64 target,struct virtual_memory_area* vma){
     return target>=vma->vm_start&&target<vma->vm_end;
 }
@@ -774,11 +778,11 @@ int mmap_valid(struct proc* p,uint64 va){
     }
     int i;
     for (i = 0; i < NVMA; ++i) {
-        if(in_Interval(va,&p->vma[i])){
-            i=-i;
+        if(!p->vma[i]){
             break;
         }
-        if(!p->vma[i].valid){
+        if(in_Interval(va,p->vma[i])){
+            i=-i;
             break;
         }
     }
@@ -788,7 +792,7 @@ int mmap_valid(struct proc* p,uint64 va){
     if(i<0){
         return -i;
     }
-    if(i==0&&p->vma[0].valid&& in_Interval(va,&p->vma[0])){
+    if(i==0&&p->vma[0]&& in_Interval(va,p->vma[0])){
         return 0;
     } else{
         return -1;
@@ -806,7 +810,7 @@ int mmap_valid(struct proc* p,uint64 va){
 int load_vma(struct proc* p,uint64 va,int index){
 #define min(a,b) ((a<b)?(a):(b))
     struct file* f=0;
-    struct virtual_memory_area* vma=&p->vma[index];
+    struct virtual_memory_area* vma=p->vma[index];
     uint32 offset=va-vma->vm_start+vma->offset;
     uint len=vma->vm_end-va;
     len=min(len,PGSIZE);
@@ -848,26 +852,33 @@ int load_vma(struct proc* p,uint64 va,int index){
 };
 int copy_vma(struct proc* p,struct proc* np){
     //copy
-    for (int i = 0; i < NVMA && p->vma[i].valid; ++i) {
-        np->vma[i]=p->vma[i];
-        np->vma[i].file=filedup(p->vma[i].file);
+    for (int i = 0; i < NVMA && p->vma[i]; ++i) {
+        if((np->vma[i]=kmem_cache_alloc(vmacache))==0){
+            while(--i>=0){
+                fileclose(np->vma[i]->file);
+                kmem_cache_free(vmacache,np->vma[i]);
+                np->vma[i]=0;
+            }
+            return -1;
+        }
+        *np->vma[i]=*p->vma[i];
+        np->vma[i]->file=filedup(p->vma[i]->file);
     }
     np->vma_bound=p->vma_bound;
     return copy(p->pagetable,np->pagetable,p->vma_bound,TRAPFRAME);
 }
 void unmap_all_vma(struct proc* p){
 //    printf("call uva,pid=%d\n",p->pid);
-    struct virtual_memory_area* vma=p->vma;
 //    uvmunmap(p->pagetable,p->vma_bound,PGROUNDUP(TRAPFRAME-p->vma_bound)/PGSIZE,1);
-    while (vma->valid){
-        unmap_vma(p,vma->vm_start,vma->vm_end,0);
+    while (p->vma[0]){
+        unmap_vma(p,p->vma[0]->vm_start,p->vma[0]->vm_end,0);
     }
 }
-void vma_swap(struct virtual_memory_area* v1,struct virtual_memory_area* v2){
+void vma_swap(struct virtual_memory_area** v1,struct virtual_memory_area** v2){
     if(v1==0||v2==0){
         panic("null swap");
     }
-    struct virtual_memory_area tmp;
+    struct virtual_memory_area* tmp;
     tmp=*v1;
     *v1=*v2;
     *v2=tmp;
@@ -877,15 +888,15 @@ int unmap_vma(struct proc* p,uint64 begin,uint64 end,int vma_index){
     //write MAP_SHARED to file
 //    printf("unmap[%p,%p]---\n",begin,end);
 //    for (int i = 0; i < NVMA; ++i) {
-//        if(!p->vma[i].valid){
+//        if(!p->vma[i]){
 //            break;
 //        }
-//        printf("---[%p,%p]\n",p->vma[i].vm_start,p->vma[i].vm_end);
+//        printf("---[%p,%p]\n",p->vma[i]->vm_start,p->vma[i]->vm_end);
 //    }
-    struct virtual_memory_area* vma=&p->vma[vma_index];
     if(vma_index==-1){
         return -1;
     }
+    struct virtual_memory_area* vma=p->vma[vma_index];
     if(vma->vm_start>begin||vma->vm_end<end||end<begin){
         return -1;
     }
@@ -921,7 +932,7 @@ int unmap_vma(struct proc* p,uint64 begin,uint64 end,int vma_index){
             continue;
         }
         if(vma->vm_flag&MAP_SHARED&&(*pte&PTE_D)){
-            begin_op();
+            begin_op_n(OP_WRITE, PGSIZE/BSIZE);
             ilock(f->ip);
             if (writei(f->ip,1,i,offset,writelen)<0){
                 iunlock(f->ip);
@@ -943,16 +954,17 @@ int unmap_vma(struct proc* p,uint64 begin,uint64 end,int vma_index){
             uvmunmap(p->pagetable, PGROUNDDOWN(vma->vm_start), 1, 1);
         }
         fileclose(vma->file);
-        vma->valid=0;
+        kmem_cache_free(vmacache,vma);
+        p->vma[vma_index]=0;
         int i=vma_index+1;
-        while (i!=NVMA&&vma[i].valid){
+        while (i!=NVMA&&p->vma[i]){
             vma_swap(&p->vma[i-1],&p->vma[i]);
             i++;
         }
     }
     int i;
     for (i = 0; i < NVMA ; ++i) {
-        if(!p->vma[i].valid){
+        if(!p->vma[i]){
             i=-i;
             break;
         }
@@ -960,8 +972,8 @@ int unmap_vma(struct proc* p,uint64 begin,uint64 end,int vma_index){
     if(i<0){
         i=-i;
         i-=1;
-        if(p->vma[i].valid){
-            p->vma_bound=p->vma[i].vm_start;
+        if(p->vma[i]){
+            p->vma_bound=p->vma[i]->vm_start;
         } else{
             panic("unmap_vma\n");
         }
@@ -969,16 +981,16 @@ int unmap_vma(struct proc* p,uint64 begin,uint64 end,int vma_index){
         if(i!=NVMA){
             panic("unmap_vma\n");
         }
-        p->vma_bound=p->vma[i].vm_start;
+        p->vma_bound=p->vma[NVMA-1]->vm_start;
     } else{
         p->vma_bound=TRAPFRAME;
     }
 //    printf("after unmap----\n");
     for (int i = 0; i < NVMA; ++i) {
-        if(!p->vma[i].valid){
+        if(!p->vma[i]){
             break;
         }
-//        printf("---[%p,%p]\n",p->vma[i].vm_start,p->vma[i].vm_end);
+//        printf("---[%p,%p]\n",p->vma[i]->vm_start,p->vma[i]->vm_end);
     }
 //    printf("unb=%p",p->vma_bound);
     return 0;
@@ -990,16 +1002,16 @@ int map_vma(struct proc* p,uint64 begin,uint64 end, int prot, int flags,
     //add to p->vma[]
     //set valid
 //    printf("map[%p,%p]\n", begin,end);
-    struct virtual_memory_area* vma=p->vma;
+    struct virtual_memory_area** vma=p->vma;
     int i;
     for (i = 0; i < NVMA; ++i) {
-        if(!vma[i].valid){
+        if(!vma[i]){
             break;
         }
     }
     int j;
     for (j = 0;  j< i; ++j) {
-        if(in_Interval(begin,&vma[j])|| in_Interval(end-1,&vma[j])){
+        if(in_Interval(begin,vma[j])|| in_Interval(end-1,vma[j])){
             return -1;
         }
     }
@@ -1009,15 +1021,17 @@ int map_vma(struct proc* p,uint64 begin,uint64 end, int prot, int flags,
     if(begin>=end){
         return -1;
     }
-    vma[i].vm_start=begin;
-    vma[i].vm_end=end;
-    vma[i].vm_prot=prot;
-    vma[i].vm_flag=flags;
-    vma[i].file= filedup(f);
-    vma[i].offset=offset;
-    vma[i].valid=1;
+    if((vma[i]=kmem_cache_alloc(vmacache))==0){
+        return -1;
+    }
+    vma[i]->vm_start=begin;
+    vma[i]->vm_end=end;
+    vma[i]->vm_prot=prot;
+    vma[i]->vm_flag=flags;
+    vma[i]->file= filedup(f);
+    vma[i]->offset=offset;
     while (i>0){
-        if(vma[i].vm_start>vma[i-1].vm_start){
+        if(vma[i]->vm_start>vma[i-1]->vm_start){
             vma_swap(&vma[i],&vma[i-1]);
         } else{
             break;
@@ -1025,7 +1039,7 @@ int map_vma(struct proc* p,uint64 begin,uint64 end, int prot, int flags,
         i--;
     }
     for (i = 0; i < NVMA ; ++i) {
-        if(!vma[i].valid){
+        if(!vma[i]){
             i=-i;
             break;
         }
@@ -1033,8 +1047,8 @@ int map_vma(struct proc* p,uint64 begin,uint64 end, int prot, int flags,
     if(i<0){
         i=-i;
         i-=1;
-        if(vma[i].valid){
-            p->vma_bound=vma[i].vm_start;
+        if(vma[i]){
+            p->vma_bound=vma[i]->vm_start;
         } else{
             panic("unmap_vma\n");
         }
@@ -1042,7 +1056,7 @@ int map_vma(struct proc* p,uint64 begin,uint64 end, int prot, int flags,
         if(i!=NVMA){
             panic("unmap_vma\n");
         }
-        p->vma_bound=vma[i].vm_start;
+        p->vma_bound=vma[NVMA-1]->vm_start;
     } else{
         p->vma_bound=TRAPFRAME;
     }
@@ -22,7 +22,8 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = NLOG;     // mkfs -l nlog
+uint flags;          // mkfs -a sets FS_ASYNC
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -76,8 +77,24 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  for(;;){
+    if(argc > 2 && strcmp(argv[1], "-l") == 0){
+      nlog = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(argc > 1 && strcmp(argv[1], "-a") == 0){
+      flags |= FS_ASYNC;
+      argc--;
+      argv++;
+    } else
+      break;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-a] [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  if(nlog < MAXOPBLOCKS+2 || 2 + nlog + ninodeblocks + nbitmap >= FSSIZE){
+    fprintf(stderr, "mkfs: bad log size %d\n", nlog);
     exit(1);
   }
 
@@ -102,6 +119,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(flags);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -260,6 +278,43 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Map the next block of din to a new block at freeblock.
+// mkfs writes each file in one go, so a file's blocks are
+// contiguous and the extents in the i-node are enough.
+uint
+extappend(struct dinode *din)
+{
+  struct extent *e;
+  uint n, next;
+
+  n = xshort(din->eh.n);
+  next = 0;
+  if(n > 0){
+    e = &din->ext[n-1];
+    if(xint(e->pblk) + xint(e->len) == freeblock){
+      e->len = xint(xint(e->len) + 1);
+      return freeblock++;
+    }
+    next = xint(e->lblk) + xint(e->len);
+  }
+  assert(n < NEXTENT);
+  e = &din->ext[n];
+  e->lblk = xint(next);
+  e->pblk = xint(freeblock);
+  e->len = xint(1);
+  din->eh.n = xshort(n + 1);
+  return freeblock++;
+}
+
+// The disk block of the last block of din.
+uint
+extlast(struct dinode *din)
+{
+  struct extent *e = &din->ext[xshort(din->eh.n) - 1];
+
+  return xint(e->pblk) + xint(e->len) - 1;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -267,7 +322,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -276,22 +330,10 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    if(off % BSIZE == 0)
+      x = extappend(&din);
+    else
+      x = extlast(&din);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -0,0 +1,161 @@
+//
+// file system benchmarks.
+//
+// fsbench read [file...]
+//   read each file sequentially and report the throughput.
+//   with no files, reads every regular file in /, which is
+//   a cold-cache sequential read right after boot.
+//
+// fsbench meta [n]
+//   create, write and unlink n small files (default 100),
+//   then again with an fsync() after each write, and report
+//   the operations per second.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+
+#define TICKHZ 10   // timer interrupts per second in qemu
+
+char buf[8192];
+
+// print n bytes moved in t ticks.
+void
+report(char *what, int n, int t)
+{
+  if(t == 0)
+    t = 1;
+  printf("%s: %d KB in %d ticks, %d KB/s\n", what, n/1024, t, n/1024*TICKHZ/t);
+}
+
+// read a whole file, returning its size or -1.
+int
+readfile(char *path)
+{
+  int fd, n, tot;
+
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf("fsbench: cannot open %s\n", path);
+    return -1;
+  }
+  tot = 0;
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    tot += n;
+  close(fd);
+  return tot;
+}
+
+// read every regular file in / once.
+int
+readroot(void)
+{
+  struct dirent de;
+  struct stat st;
+  char path[DIRSIZ+2];
+  int fd, n, tot;
+
+  if((fd = open("/", O_RDONLY)) < 0){
+    printf("fsbench: cannot open /\n");
+    exit(1);
+  }
+  tot = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    path[0] = '/';
+    memmove(path+1, de.name, DIRSIZ);
+    path[DIRSIZ+1] = 0;
+    if(stat(path, &st) < 0 || st.type != T_FILE)
+      continue;
+    if((n = readfile(path)) > 0)
+      tot += n;
+  }
+  close(fd);
+  return tot;
+}
+
+void
+readbench(int argc, char *argv[])
+{
+  int i, n, t0, pass;
+
+  for(pass = 0; pass < 2; pass++){
+    t0 = uptime();
+    n = 0;
+    if(argc == 0)
+      n = readroot();
+    for(i = 0; i < argc; i++)
+      n += readfile(argv[i]);
+    report(pass == 0 ? "read (first pass)" : "read (cached)", n, uptime() - t0);
+  }
+}
+
+// create, write and unlink n files, syncing each if sync is set.
+// returns the number of file system calls made.
+int
+metaloop(int n, int sync)
+{
+  char name[8];
+  int i, fd;
+
+  name[0] = 'm';
+  name[4] = 0;
+  for(i = 0; i < n; i++){
+    name[1] = '0' + i/100%10;
+    name[2] = '0' + i/10%10;
+    name[3] = '0' + i%10;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("fsbench: cannot create %s\n", name);
+      exit(1);
+    }
+    if(write(fd, buf, 512) != 512){
+      printf("fsbench: write %s failed\n", name);
+      exit(1);
+    }
+    if(sync && fsync(fd) < 0){
+      printf("fsbench: fsync %s failed\n", name);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+  return n * (sync ? 5 : 4);
+}
+
+void
+metabench(int argc, char *argv[])
+{
+  int n, ops, t, sync;
+
+  n = argc > 0 ? atoi(argv[0]) : 100;
+  for(sync = 0; sync < 2; sync++){
+    t = uptime();
+    ops = metaloop(n, sync);
+    t = uptime() - t;
+    if(t == 0)
+      t = 1;
+    printf("%s: %d ops in %d ticks, %d ops/s\n",
+           sync ? "meta (fsync)" : "meta", ops, t, ops*TICKHZ/t);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 2){
+    printf("usage: fsbench read [file...] | meta [n]\n");
+    exit(1);
+  }
+  if(strcmp(argv[1], "read") == 0)
+    readbench(argc-2, argv+2);
+  else if(strcmp(argv[1], "meta") == 0)
+    metabench(argc-2, argv+2);
+  else {
+    printf("fsbench: unknown benchmark %s\n", argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
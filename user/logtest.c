@@ -0,0 +1,85 @@
+//
+// log recovery test.
+//
+// logtest big
+//   in one transaction, on a file system made with mkfs -a,
+//   make NDIR directories, which logs more blocks than the
+//   buffer cache's minimum size, and fsync() it. kill qemu
+//   right after, before a checkpoint, so that the next boot
+//   has to recover the transaction from the log.
+// logtest check
+//   after that reboot, check that the directories are there.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NDIR 48
+
+char *
+dirname(int i)
+{
+  static char name[8];
+
+  strcpy(name, "lt/d00");
+  name[4] = '0' + i/10;
+  name[5] = '0' + i%10;
+  return name;
+}
+
+void
+big(void)
+{
+  int i, fd;
+
+  if(mkdir("lt") < 0){
+    printf("logtest: mkdir lt failed\n");
+    exit(1);
+  }
+  for(i = 0; i < NDIR; i++){
+    if(mkdir(dirname(i)) < 0){
+      printf("logtest: mkdir %s failed\n", dirname(i));
+      exit(1);
+    }
+  }
+  if((fd = open("lt", O_RDONLY)) < 0 || fsync(fd) < 0){
+    printf("logtest: fsync failed\n");
+    exit(1);
+  }
+  close(fd);
+  printf("logtest: committed\n");
+}
+
+void
+check(void)
+{
+  struct stat st;
+  char path[16];
+  int i;
+
+  for(i = 0; i < NDIR; i++){
+    strcpy(path, dirname(i));
+    strcpy(path + strlen(path), "/.");
+    if(stat(path, &st) < 0 || st.type != T_DIR){
+      printf("logtest: %s missing after recovery\n", dirname(i));
+      exit(1);
+    }
+  }
+  printf("logtest: ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 2 && strcmp(argv[1], "big") == 0)
+    big();
+  else if(argc == 2 && strcmp(argv[1], "check") == 0)
+    check();
+  else {
+    printf("usage: logtest big | check\n");
+    exit(1);
+  }
+  exit(0);
+}
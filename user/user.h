@@ -31,6 +31,8 @@ void* sigra(void);
 int symlink(char *target, char *path);
 void *mmap(void *addr, uint32 length, int prot, int flags,int fd, uint32 offset);
 int  munmap(void *addr,uint32 len);
+int fsync(int);
+int fdatasync(int);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
 #endif
@@ -43,3 +43,5 @@ entry("sigra");
 entry("symlink");
 entry("mmap");
 entry("munmap");
+entry("fsync");
+entry("fdatasync");